@@ -6,7 +6,24 @@
 
 #include <cmath>
 
-#include <stack>
+
+#include <algorithm>
+
+#include <thread>
+
+#include <atomic>
+
+#include <fstream>
+
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
 
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
@@ -21,6 +38,175 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Index of the grid cell that contains the coordinate value (rounded towards negative infinity)
+int grid_cell(int value, int cell_size)
+{
+    return value >= 0 ? value / cell_size : -((-(value + 1)) / cell_size) - 1;
+}
+
+// Key of a grid cell in the cell map: the cell coordinates packed into the high and low halves
+std::uint64_t grid_key(int cx, int cy)
+{
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(cx)) << 32) | static_cast<std::uint32_t>(cy);
+}
+
+// Cell coordinates of a cell map key
+std::pair<int, int> grid_key_cell(std::uint64_t key)
+{
+    return {static_cast<std::int32_t>(static_cast<std::uint32_t>(key >> 32)), static_cast<std::int32_t>(static_cast<std::uint32_t>(key))};
+}
+
+// Key of a coordinate in the coordinate order index: (squared distance from origin, y coord)
+std::pair<long long int, int> coord_order_key(Coord xy)
+{
+    long long int x = xy.x;
+    long long int y = xy.y;
+    return {x*x + y*y, xy.y};
+}
+
+// Length of a way: the sum of its segment lengths, each truncated to an integer
+Distance way_length(std::vector<Coord> const& coords)
+{
+    struct {
+        Distance operator()(Coord a, Coord b)
+                 //Calculate the distance between two coords
+                const { return sqrt(floor(pow((a.x - b.x), 2)) + floor(pow((a.y - b.y), 2))); }
+    }calculateDistance;
+
+    Distance distance = 0;
+    for(unsigned int i = 1; i < coords.size(); i++){
+        distance += calculateDistance(coords[i-1], coords[i]);
+    }
+    return distance;
+}
+
+// Binary snapshot file: a magic string and a format version, then the places, areas, subarea links,
+// ways and crossroads as length prefixed lists. Numbers are stored in the byte order of the host.
+char const SNAPSHOT_MAGIC[8] = {'P', 'R', 'G', '2', 'S', 'N', 'A', 'P'};
+std::uint32_t const SNAPSHOT_VERSION = 1;
+
+struct snapshot_writer
+{
+    std::string buffer;
+
+    template <typename Type>
+    void put(Type value)
+    {
+        buffer.append(reinterpret_cast<char const*>(&value), sizeof(value));
+    }
+    void put_string(std::string const& text)
+    {
+        put<std::uint32_t>(text.size());
+        buffer.append(text);
+    }
+    void put_coord(Coord xy)
+    {
+        put<std::int32_t>(xy.x);
+        put<std::int32_t>(xy.y);
+    }
+    void put_coords(std::vector<Coord> const& coords)
+    {
+        put<std::uint32_t>(coords.size());
+        for (Coord xy : coords){
+            put_coord(xy);
+        }
+    }
+};
+
+// Reading past the end of the buffer clears ok and returns zeros, so callers check ok once per record
+struct snapshot_reader
+{
+    char const* pos;
+    char const* end;
+    bool ok = true;
+
+    template <typename Type>
+    Type get()
+    {
+        Type value{};
+        if (static_cast<std::size_t>(end - pos) < sizeof(value)){
+            ok = false;
+            pos = end;
+            return value;
+        }
+        std::memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+    std::string get_string()
+    {
+        std::size_t length = get<std::uint32_t>();
+        if (static_cast<std::size_t>(end - pos) < length){
+            ok = false;
+            pos = end;
+            return {};
+        }
+        std::string text(pos, length);
+        pos += length;
+        return text;
+    }
+    Coord get_coord()
+    {
+        int x = get<std::int32_t>();
+        int y = get<std::int32_t>();
+        return {x, y};
+    }
+    std::vector<Coord> get_coords()
+    {
+        std::size_t count = get<std::uint32_t>();
+        // Every coordinate takes 8 bytes, so a count larger than the rest of the file is broken
+        if (static_cast<std::size_t>(end - pos) / 8 < count){
+            ok = false;
+            pos = end;
+            return {};
+        }
+        std::vector<Coord> coords;
+        coords.reserve(count);
+        for (std::size_t i = 0; i < count; i++){
+            coords.push_back(get_coord());
+        }
+        return coords;
+    }
+    // Element counts are checked against the bytes left so that a broken file cannot ask for huge reservations
+    template <typename Count = std::uint64_t>
+    std::size_t get_count(std::size_t min_record_size)
+    {
+        std::uint64_t count = get<Count>();
+        if (count > static_cast<std::size_t>(end - pos) / min_record_size){
+            ok = false;
+            pos = end;
+            return 0;
+        }
+        return count;
+    }
+};
+
+// Memory mapped graph file: this header, then the sections at 8 byte aligned offsets from the start
+// of the file. Coordinates are stored as Coord, all other numbers as fixed size integers.
+char const GRAPH_FILE_MAGIC[8] = {'P', 'R', 'G', '2', 'G', 'R', 'P', 'H'};
+std::uint32_t const GRAPH_FILE_VERSION = 1;
+
+struct graph_file_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t crossroad_count;
+    std::uint32_t edge_count;
+    std::uint32_t way_count;
+    std::uint32_t place_count;
+    std::uint32_t text_size;
+    // Section offsets
+    std::uint64_t coords;
+    std::uint64_t offsets;
+    std::uint64_t targets;
+    std::uint64_t weights;
+    std::uint64_t edge_ways;
+    std::uint64_t coord_order;
+    std::uint64_t way_id_offsets;
+    std::uint64_t places;
+    std::uint64_t text;
+};
+
 // Modify the code below to implement the functionality of the class.
 // Also remove comments from the parameter names when you implement
 // an operation (Commenting out parameter name prevents compiler from
@@ -28,7 +214,9 @@ Type random_in_range(Type start, Type end)
 
 Datastructures::Datastructures()
 {
-    // Replace this comment with your implementation
+    // Queries on the published snapshot work from the start, before any creation_finished()
+    build_graph();
+    publish_snapshot();
 }
 
 Datastructures::~Datastructures()
@@ -38,19 +226,38 @@ Datastructures::~Datastructures()
 
 int Datastructures::place_count()
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
     return places_.size();
 }
 
 void Datastructures::clear_all()
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    erase_places_areas();
+}
 
+void Datastructures::erase_places_areas()
+{
     places_.clear();
+    places_by_name_.clear();
+    places_by_coord_.clear();
+    for (auto& bucket : places_by_type_)
+        bucket.clear();
+    for (auto& grid : grids_by_type_)
+        grid = {};
     areas_.clear();
+    bulk_places_.clear();
+    area_index_valid_ = false;
+    all_places_changed_ = true;
+    changed_places_ = {};
+    all_areas_changed_ = true;
+    changed_areas_ = {};
 }
 
 std::vector<PlaceID> Datastructures::all_places()
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
     std::vector<PlaceID> place_id_list;
 
@@ -62,44 +269,75 @@ std::vector<PlaceID> Datastructures::all_places()
 
 bool Datastructures::add_place(PlaceID id, const Name& name, PlaceType type, Coord xy)
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    return insert_place(id, name, type, xy);
+}
 
-    if ( places_.find(id) != places_.end() ){
+bool Datastructures::insert_place(PlaceID id, const Name& name, PlaceType type, Coord xy)
+{
+    auto insertion_result = places_.try_emplace(id);
+    if ( !insertion_result.second ){
         return false;
     }
 
-    place place_data;
+    place& place_data = insertion_result.first->second;
     place_data.name = name;
     place_data.place_type = type;
     place_data.coord = xy;
-
-    places_.insert(std::make_pair(id, place_data));
+    if (bulk_loading_){
+        bulk_places_.push_back({id, &place_data});
+    }
+    else {
+        place_data.name_it = places_by_name_.insert(std::make_pair(name, id));
+        place_data.coord_it = places_by_coord_.insert(std::make_pair(coord_order_key(xy), id));
+        index_place(id, place_data);
+    }
+    mark_place_changed(id);
 
     return true;
 }
 
+void Datastructures::index_place(PlaceID id, place& place_data)
+{
+    auto& bucket = places_by_type_[static_cast<std::size_t>(place_data.place_type)];
+    place_data.type_index = bucket.size();
+    bucket.push_back(id);
+
+    grid_insert(id, place_data.place_type, place_data.coord);
+}
+
 std::pair<Name, PlaceType> Datastructures::get_place_name_type(PlaceID id)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if ( places_.find(id) == places_.end() ) {
+    auto it = places_.find(id);
+    if ( it == places_.end() ) {
         return {NO_NAME, PlaceType::NO_TYPE};
     }
 
-    return {places_[id].name, places_[id].place_type};
+    return {it->second.name, it->second.place_type};
 }
 
 Coord Datastructures::get_place_coord(PlaceID id)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if ( places_.find(id) == places_.end() ) {
-        return NO_COORD;;
+    auto it = places_.find(id);
+    if ( it == places_.end() ) {
+        return NO_COORD;
     }
 
-    return places_[id].coord;
+    return it->second.coord;
 }
 
 bool Datastructures::add_area(AreaID id, const Name &name, std::vector<Coord> coords)
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    return insert_area(id, name, std::move(coords));
+}
 
+bool Datastructures::insert_area(AreaID id, const Name &name, std::vector<Coord> coords)
+{
     if ( areas_.find(id) != areas_.end() ){
         return false;
     }
@@ -107,131 +345,317 @@ bool Datastructures::add_area(AreaID id, const Name &name, std::vector<Coord> co
     area area_data;
     area_data.id = id;
     area_data.name = name;
-    area_data.coords = coords;
+    area_data.coords = std::move(coords);
     area_data.subareas = {};
     area_data.parent_area = nullptr;
 
     areas_.insert(std::make_pair(id, area_data));
+    area_index_valid_ = false;
+    mark_area_changed(id);
 
     return true;
 }
 
 Name Datastructures::get_area_name(AreaID id)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if ( areas_.find(id) == areas_.end() ) {
+    auto it = areas_.find(id);
+    if ( it == areas_.end() ) {
         return NO_NAME;
     }
 
-    return areas_[id].name;
+    return it->second.name;
 }
 
 std::vector<Coord> Datastructures::get_area_coords(AreaID id)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if ( areas_.find(id) == areas_.end() ) {
+    auto it = areas_.find(id);
+    if ( it == areas_.end() ) {
         return {NO_COORD};
     }
 
-    return areas_[id].coords;
+    return it->second.coords;
 }
 
 void Datastructures::creation_finished()
 {
-    // Replace this comment with your implementation
-    // NOTE!! It's quite ok to leave this empty, if you don't need operations
-    // that are performed after all additions have been done.
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+    if (!area_index_valid_){
+        build_area_index();
+    }
+    if (!graph_valid_){
+        build_graph();
+    }
+    publish_snapshot();
 }
 
-
-std::vector<PlaceID> Datastructures::places_alphabetically()
+std::shared_ptr<Datastructures::snapshot const> Datastructures::published_snapshot()
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    return snapshot_;
+}
 
-    std::multimap<Name, PlaceID> sorted_by_name;
-    std::vector<PlaceID> id_alphabetical_order;
+template <typename Key, typename Record, typename Live, typename MakeRecord>
+std::shared_ptr<Datastructures::chunked_table<Key, Record> const> Datastructures::next_table(
+        chunked_table<Key, Record> const* previous, std::vector<Key> const& changed, bool all_changed,
+        Live const& live, MakeRecord make_record)
+{
+    using table = chunked_table<Key, Record>;
+    auto next = std::make_shared<table>();
+
+    // The chunks are laid out again when the table has grown or shrunk to twice or half of the
+    // size they were laid out for, so a chunk keeps O(CHUNK_SIZE) records
+    std::size_t chunk_count = std::max<std::size_t>(1, live.size() / table::CHUNK_SIZE);
+    if (previous == nullptr or all_changed or chunk_count > 2 * previous->chunks.size()
+            or 2 * chunk_count < previous->chunks.size()){
+        std::vector<std::shared_ptr<typename table::chunk>> chunks;
+        chunks.reserve(chunk_count);
+        for (std::size_t i = 0; i < chunk_count; i++){
+            chunks.push_back(std::make_shared<typename table::chunk>());
+        }
+        next->chunks.assign(chunks.begin(), chunks.end());
+        for (auto& [key, value] : live){
+            chunks[next->chunk_of(key)]->insert({key, std::make_shared<Record const>(make_record(value))});
+        }
+        return next;
+    }
 
-    for (auto& place_id : places_)
-        sorted_by_name.insert(std::make_pair(place_id.second.name, place_id.first));
+    next->chunks = previous->chunks;
+    std::vector<std::shared_ptr<typename table::chunk>> copies(next->chunks.size());
+    for (Key key : changed){
+        std::size_t index = next->chunk_of(key);
+        if (copies[index] == nullptr){
+            copies[index] = std::make_shared<typename table::chunk>(*next->chunks[index]);
+            next->chunks[index] = copies[index];
+        }
+        auto it = live.find(key);
+        if (it == live.end()){
+            copies[index]->erase(key);
+        }
+        else {
+            copies[index]->insert_or_assign(key, std::make_shared<Record const>(make_record(it->second)));
+        }
+    }
+    return next;
+}
 
-    for (auto& name : sorted_by_name)
-        id_alphabetical_order.push_back(name.second);
+void Datastructures::mark_place_changed(PlaceID id)
+{
+    // Once more ids have changed than there are places, laying the whole table out is cheaper
+    if (!all_places_changed_){
+        changed_places_.push_back(id);
+        if (changed_places_.size() > places_.size()){
+            all_places_changed_ = true;
+            changed_places_ = {};
+        }
+    }
+}
 
-    return {id_alphabetical_order};
+void Datastructures::mark_area_changed(AreaID id)
+{
+    if (!all_areas_changed_){
+        changed_areas_.push_back(id);
+        if (changed_areas_.size() > areas_.size()){
+            all_areas_changed_ = true;
+            changed_areas_ = {};
+        }
+    }
 }
 
+void Datastructures::publish_snapshot()
+{
+    std::shared_ptr<snapshot> next(new snapshot);
+    snapshot const* previous = snapshot_.get();
+
+    next->places_ = next_table(previous == nullptr ? nullptr : previous->places_.get(), changed_places_,
+                               all_places_changed_, places_, [](place const& current){
+        return place_record{current.name, current.place_type, current.coord};
+    });
+    next->areas_ = next_table(previous == nullptr ? nullptr : previous->areas_.get(), changed_areas_,
+                              all_areas_changed_, areas_, [](area const& current){
+        return area_record{current.name, current.coords, current.parent_area == nullptr ? NO_AREA : current.parent_area->id};
+    });
+
+    // Every change of the ways invalidates the graph, so an unchanged graph means unchanged ways
+    if (previous == nullptr or previous->graph_ != graph_){
+        auto way_handles = std::make_shared<way_index>();
+        way_handles->reserve(way_handles_.size());
+        for (WayHandle handle = 0; handle < graph_->ways.size(); handle++){
+            if (graph_->ways[handle] != nullptr){
+                way_handles->insert({graph_->ways[handle]->id, handle});
+            }
+        }
+        next->way_handles_ = std::move(way_handles);
+    }
+    else {
+        next->way_handles_ = previous->way_handles_;
+    }
+    next->graph_ = graph_;
+
+    snapshot_ = std::move(next);
+    changed_places_ = {};
+    all_places_changed_ = false;
+    changed_areas_ = {};
+    all_areas_changed_ = false;
+}
 
-std::vector<PlaceID> Datastructures::places_coord_order()
+void Datastructures::build_area_index()
 {
+    std::size_t const no_depth = std::numeric_limits<std::size_t>::max();
 
-    std::vector<PlaceID> id_coord_order;
+    area_order_.clear();
+    area_order_.reserve(areas_.size());
+    for (auto& area_id : areas_){
+        area_id.second.index = area_order_.size();
+        area_order_.push_back(&area_id.second);
+    }
 
-    struct coords_data{
-        double distance;
-        PlaceID id;
-        int y_coord;
-    };
-    coords_data coord;
-    std::vector<coords_data> coords_data_list;
+    std::size_t area_count = area_order_.size();
+    area_depth_.assign(area_count, no_depth);
+
+    // Depths are found by walking up until an area with known depth (or a root) is met
+    std::vector<area*> path;
+    std::size_t max_depth = 0;
+    for (auto current : area_order_){
+        while (area_depth_[current->index] == no_depth){
+            path.push_back(current);
+            if (current->parent_area == nullptr){
+                break;
+            }
+            current = current->parent_area;
+        }
+        std::size_t depth = area_depth_[current->index] == no_depth ? 0 : area_depth_[current->index] + 1;
+        while (!path.empty()){
+            area_depth_[path.back()->index] = depth;
+            max_depth = std::max(max_depth, depth);
+            path.pop_back();
+            depth++;
+        }
+    }
 
-    struct {
-        bool operator()(struct coords_data a, struct coords_data b)
-                 //if distance is equal sort based on y coord
-                const { if (a.distance == b.distance) {
-                        return a.y_coord < b.y_coord; }
+    std::size_t levels = 1;
+    while ((std::size_t(1) << levels) <= max_depth){
+        levels++;
+    }
 
-                return a.distance < b.distance; }
-    }coordsort;
+    area_ancestors_.assign(levels, std::vector<std::size_t>(area_count));
+    for (std::size_t i = 0; i < area_count; i++){
+        area* parent = area_order_[i]->parent_area;
+        area_ancestors_[0][i] = parent == nullptr ? i : parent->index;
+    }
+    for (std::size_t k = 1; k < levels; k++){
+        for (std::size_t i = 0; i < area_count; i++){
+            area_ancestors_[k][i] = area_ancestors_[k-1][area_ancestors_[k-1][i]];
+        }
+    }
 
-    for (auto& place_id : places_){
-        int x = place_id.second.coord.x;
-        int y = place_id.second.coord.y;
-        double distance = std::sqrt(x*x + y*y);
-        coord.distance = distance;
-        coord.id = place_id.first;
-        coord.y_coord = y;
-        coords_data_list.push_back(coord);
+    // Pre-order layout with an explicit stack, children are pushed in reverse to keep their order
+    area_preorder_.clear();
+    area_preorder_.reserve(area_count);
+    area_preorder_pos_.assign(area_count, 0);
+    std::vector<area*> stack;
+    for (auto root : area_order_){
+        if (root->parent_area != nullptr){
+            continue;
+        }
+        stack.push_back(root);
+        while (!stack.empty()){
+            area* current = stack.back();
+            stack.pop_back();
+            area_preorder_pos_[current->index] = area_preorder_.size();
+            area_preorder_.push_back(current->id);
+            for (auto sub_area = current->subareas.rbegin(); sub_area != current->subareas.rend(); ++sub_area){
+                stack.push_back(*sub_area);
+            }
+        }
+    }
+
+    // Subtree sizes are summed up from the end of the pre-order, children always come after parents
+    area_subtree_size_.assign(area_count, 1);
+    for (std::size_t pos = area_preorder_.size(); pos-- > 0;){
+        area const& current = areas_.at(area_preorder_[pos]);
+        if (current.parent_area != nullptr){
+            area_subtree_size_[current.parent_area->index] += area_subtree_size_[current.index];
+        }
     }
 
-    std::sort(coords_data_list.begin(), coords_data_list.end(), coordsort);
+    area_index_valid_ = true;
+}
 
-    for (auto& i : coords_data_list){
-        id_coord_order.push_back(i.id);
+void Datastructures::ensure_area_index()
+{
+    if (area_index_valid_){
+        return;
+    }
+    std::lock_guard<std::mutex> build_lock(index_mutex_);
+    if (!area_index_valid_){
+        build_area_index();
     }
+}
+
+
+std::vector<PlaceID> Datastructures::places_alphabetically()
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+
+    std::vector<PlaceID> id_alphabetical_order;
+    id_alphabetical_order.reserve(places_by_name_.size());
+
+    for (auto& name : places_by_name_)
+        id_alphabetical_order.push_back(name.second);
+
+    return {id_alphabetical_order};
+}
+
+
+std::vector<PlaceID> Datastructures::places_coord_order()
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+
+    std::vector<PlaceID> id_coord_order;
+    id_coord_order.reserve(places_by_coord_.size());
+
+    for (auto& coord : places_by_coord_)
+        id_coord_order.push_back(coord.second);
 
     return {id_coord_order};
 }
 
 std::vector<PlaceID> Datastructures::find_places_name(Name const& name)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
     std::vector<PlaceID> id_list;
 
-    for (auto& place_id : places_)
-        if (place_id.second.name == name){
-            id_list.push_back(place_id.first);
-        }
+    auto range = places_by_name_.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it)
+        id_list.push_back(it->second);
 
     return {id_list};
 }
 
 std::vector<PlaceID> Datastructures::find_places_type(PlaceType type)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    std::vector<PlaceID> id_list;
-
-    for (auto& place_id : places_)
-        if (place_id.second.place_type == type){
-            id_list.push_back(place_id.first);
-        }
-
-    return {id_list};
+    return places_by_type_[static_cast<std::size_t>(type)];
 }
 
 bool Datastructures::change_place_name(PlaceID id, const Name& newname)
 {
-
-    if(places_.find(id) != places_.end()){
-        places_[id].name = newname;
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+
+    auto it = places_.find(id);
+    if(it != places_.end()){
+        places_by_name_.erase(it->second.name_it);
+        it->second.name = newname;
+        it->second.name_it = places_by_name_.insert(std::make_pair(newname, id));
+        mark_place_changed(id);
         return true;
     }
 
@@ -240,17 +664,82 @@ bool Datastructures::change_place_name(PlaceID id, const Name& newname)
 
 bool Datastructures::change_place_coord(PlaceID id, Coord newcoord)
 {
-
-    if(places_.find(id) != places_.end()){
-        places_[id].coord = newcoord;
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+
+    auto it = places_.find(id);
+    if(it != places_.end()){
+        grid_erase(id, it->second.place_type, it->second.coord);
+        places_by_coord_.erase(it->second.coord_it);
+        it->second.coord = newcoord;
+        it->second.coord_it = places_by_coord_.insert(std::make_pair(coord_order_key(newcoord), id));
+        grid_insert(id, it->second.place_type, newcoord);
+        mark_place_changed(id);
         return true;
     }
 
     return false;
 }
 
+void Datastructures::grid_insert(PlaceID id, PlaceType type, Coord xy)
+{
+    place_grid& grid = grids_by_type_[static_cast<std::size_t>(type)];
+    int cx = grid_cell(xy.x, GRID_CELL_SIZE);
+    int cy = grid_cell(xy.y, GRID_CELL_SIZE);
+
+    auto& ids = grid.cells[grid_key(cx, cy)];
+    if (ids.empty()){
+        grid.column_cells[cx]++;
+        grid.row_cells[cy]++;
+        update_grid_bounds(grid);
+    }
+    ids.push_back(id);
+}
+
+void Datastructures::grid_erase(PlaceID id, PlaceType type, Coord xy)
+{
+    place_grid& grid = grids_by_type_[static_cast<std::size_t>(type)];
+    int cx = grid_cell(xy.x, GRID_CELL_SIZE);
+    int cy = grid_cell(xy.y, GRID_CELL_SIZE);
+    auto cell = grid.cells.find(grid_key(cx, cy));
+    if (cell == grid.cells.end()){
+        return;
+    }
+
+    auto& ids = cell->second;
+    auto pos = std::find(ids.begin(), ids.end(), id);
+    if (pos != ids.end()){
+        *pos = ids.back();
+        ids.pop_back();
+    }
+    if (ids.empty()){
+        grid.cells.erase(cell);
+        for (auto [lines, line] : {std::make_pair(&grid.column_cells, cx), std::make_pair(&grid.row_cells, cy)}){
+            auto count = lines->find(line);
+            if (--count->second == 0){
+                lines->erase(count);
+            }
+        }
+        update_grid_bounds(grid);
+    }
+}
+
+void Datastructures::update_grid_bounds(place_grid& grid)
+{
+    if (grid.cells.empty()){
+        grid.min_cx = grid.min_cy = 0;
+        grid.max_cx = grid.max_cy = -1;
+        return;
+    }
+    grid.min_cx = grid.column_cells.begin()->first;
+    grid.max_cx = grid.column_cells.rbegin()->first;
+    grid.min_cy = grid.row_cells.begin()->first;
+    grid.max_cy = grid.row_cells.rbegin()->first;
+}
+
 std::vector<AreaID> Datastructures::all_areas()
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
     std::vector<PlaceID> area_id_list;
 
@@ -262,99 +751,205 @@ std::vector<AreaID> Datastructures::all_areas()
 
 bool Datastructures::add_subarea_to_area(AreaID id, AreaID parentid)
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    return link_subarea(id, parentid);
+}
 
+bool Datastructures::link_subarea(AreaID id, AreaID parentid)
+{
     if (areas_.find(id) == areas_.end() or areas_.find(parentid) == areas_.end()){
         return false;
     }
 
     areas_[parentid].subareas.push_back(&areas_[id]);
     areas_[id].parent_area = &areas_[parentid];
+    area_index_valid_ = false;
+    mark_area_changed(id);
     return true;
 }
 
 std::vector<AreaID> Datastructures::subarea_in_areas(AreaID id)
 {
-    if(areas_.find(id) == areas_.end()){
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    auto it = areas_.find(id);
+    if(it == areas_.end()){
         return {NO_AREA};
     }
 
-    parent_areas.clear();
-    check_parentareas(id);
-    return parent_areas;
-}
-
-void Datastructures::check_parentareas(AreaID id)
-{
-    if (areas_[id].parent_area == nullptr){
-        return;
+    std::vector<AreaID> parent_areas;
+    if (area_index_valid_){
+        parent_areas.reserve(area_depth_[it->second.index]);
+    }
+    for (area* parent = it->second.parent_area; parent != nullptr; parent = parent->parent_area){
+        parent_areas.push_back(parent->id);
     }
-    parent_areas.push_back(areas_[id].parent_area->id);
-    check_parentareas(areas_[id].parent_area->id);
+    return parent_areas;
 }
 
 std::vector<PlaceID> Datastructures::places_closest_to(Coord xy, PlaceType type)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    std::vector<PlaceID> id_close_places;
+    std::size_t const max_places = 3;
 
     struct coords_data{
-        PlaceID id;
-        double distance;
+        long long int distance;
         int y_coord;
+        PlaceID id;
     };
-    coords_data coord;
-
-    std::vector<coords_data> coords_data_list;
 
     struct {
-        bool operator()(struct coords_data a, struct coords_data b)
+        bool operator()(coords_data const& a, coords_data const& b)
                  //if distance is equal sort based on y coord
-                const { if( a.distance == b.distance) {
+                const { if (a.distance == b.distance) {
                         return a.y_coord < b.y_coord; }
 
                 return a.distance < b.distance; }
     }coordsort;
 
-    for (auto& place : places_){
-        if (type != PlaceType::NO_TYPE){
-            if (place.second.place_type == type){
-                int x = xy.x;
-                int y = xy.y;
-                coord.id = place.first;
-                double distance = std::sqrt(pow((x - place.second.coord.x), 2) + pow((y - place.second.coord.y), 2));
-                coord.distance = distance;
-                coord.y_coord = y;
-                coords_data_list.push_back(coord);
-            }
+    // Grids that are searched, the combined cell bounds of them and the amount of non-empty cells
+    std::vector<place_grid const*> grids;
+    int min_cx = 0, max_cx = 0, min_cy = 0, max_cy = 0;
+    std::size_t cell_count = 0;
+    for (std::size_t i = 0; i < grids_by_type_.size(); i++){
+        if (type != PlaceType::NO_TYPE and i != static_cast<std::size_t>(type)){
+            continue;
+        }
+        place_grid const& grid = grids_by_type_[i];
+        if (grid.cells.empty()){
+            continue;
+        }
+        if (grids.empty()){
+            min_cx = grid.min_cx; max_cx = grid.max_cx;
+            min_cy = grid.min_cy; max_cy = grid.max_cy;
         }
         else {
-            int x = xy.x;
-            int y = xy.y;
-            coord.id = place.first;
-            double distance = std::sqrt(pow((x - place.second.coord.x), 2) + pow((y - place.second.coord.y), 2));
-            coord.distance = distance;
-            coord.y_coord = y;
-            coords_data_list.push_back(coord);
+            min_cx = std::min(min_cx, grid.min_cx); max_cx = std::max(max_cx, grid.max_cx);
+            min_cy = std::min(min_cy, grid.min_cy); max_cy = std::max(max_cy, grid.max_cy);
         }
+        cell_count += grid.cells.size();
+        grids.push_back(&grid);
+    }
+    if (grids.empty()){
+        return {};
     }
 
-    std::sort(coords_data_list.begin(), coords_data_list.end(), coordsort);
+    // Closest places found so far, kept in order
+    std::vector<coords_data> closest;
+
+    auto check_places = [&](std::vector<PlaceID> const& ids){
+        for (PlaceID id : ids){
+            Coord place_xy = places_.at(id).coord;
+            long long int dx = static_cast<long long int>(place_xy.x) - xy.x;
+            long long int dy = static_cast<long long int>(place_xy.y) - xy.y;
+            coords_data candidate = {dx*dx + dy*dy, place_xy.y, id};
+            if (closest.size() == max_places and !coordsort(candidate, closest.back())){
+                continue;
+            }
+            closest.insert(std::upper_bound(closest.begin(), closest.end(), candidate, coordsort), candidate);
+            if (closest.size() > max_places){
+                closest.pop_back();
+            }
+        }
+    };
+
+    auto check_cell = [&](long long int cx, long long int cy){
+        if (cx < min_cx or cx > max_cx or cy < min_cy or cy > max_cy){
+            return;
+        }
+        std::uint64_t key = grid_key(cx, cy);
+        for (auto grid : grids){
+            auto cell = grid->cells.find(key);
+            if (cell != grid->cells.end()){
+                check_places(cell->second);
+            }
+        }
+    };
+
+    // Squared distance from xy to the closest point of the cells outside the block of rings 0..ring
+    auto outside_distance = [&](long long int qcx, long long int qcy, long long int ring){
+        long long int block_min_x = (qcx - ring) * GRID_CELL_SIZE;
+        long long int block_max_x = (qcx + ring + 1) * GRID_CELL_SIZE;
+        long long int block_min_y = (qcy - ring) * GRID_CELL_SIZE;
+        long long int block_max_y = (qcy + ring + 1) * GRID_CELL_SIZE;
+        long long int outside = std::min({xy.x - block_min_x + 1, block_max_x - xy.x,
+                                          xy.y - block_min_y + 1, block_max_y - xy.y});
+        return outside*outside;
+    };
+
+    long long int qcx = grid_cell(xy.x, GRID_CELL_SIZE);
+    long long int qcy = grid_cell(xy.y, GRID_CELL_SIZE);
+
+    // Rings closer than the bounds cannot contain any places
+    long long int ring = std::max({0LL, min_cx - qcx, qcx - max_cx, min_cy - qcy, qcy - max_cy});
+
+    // The rings are searched only as long as they have visited fewer cells than there are
+    // non-empty cells, after that checking the non-empty cells directly is cheaper
+    std::size_t cells_visited = 0;
+    bool rings_done = false;
+    while (cells_visited < cell_count){
+        if (ring == 0){
+            check_cell(qcx, qcy);
+        }
+        else {
+            for (long long int dx = std::max(-ring, min_cx - qcx); dx <= std::min(ring, max_cx - qcx); dx++){
+                check_cell(qcx + dx, qcy - ring);
+                check_cell(qcx + dx, qcy + ring);
+            }
+            for (long long int dy = std::max(-ring + 1, min_cy - qcy); dy <= std::min(ring - 1, max_cy - qcy); dy++){
+                check_cell(qcx - ring, qcy + dy);
+                check_cell(qcx + ring, qcy + dy);
+            }
+        }
+        cells_visited += ring == 0 ? 1 : 8 * ring;
 
-    if (coords_data_list.size() < 3 ){
-        for (auto& i : coords_data_list){
-            id_close_places.push_back(i.id);
+        // Stop when the searched block covers every cell or every place outside it is too far away
+        if ((qcx - ring <= min_cx and qcx + ring >= max_cx and qcy - ring <= min_cy and qcy + ring >= max_cy)
+                or (closest.size() == max_places and closest.back().distance < outside_distance(qcx, qcy, ring))){
+            rings_done = true;
+            break;
         }
+        ring++;
     }
-    else {
-        for (int i = 0; i < 3; i++){
-            id_close_places.push_back(coords_data_list[i].id);
+
+    if (!rings_done){
+        // Cells outside the searched block are taken in order of their distance from xy until the
+        // closest remaining cell is farther away than the third closest place
+        std::vector<std::pair<long long int, std::vector<PlaceID> const*>> cells;
+        cells.reserve(cell_count);
+        for (auto grid : grids){
+            for (auto& cell : grid->cells){
+                auto [cx, cy] = grid_key_cell(cell.first);
+                if (std::abs(cx - qcx) < ring and std::abs(cy - qcy) < ring){
+                    continue;
+                }
+                long long int cell_x = static_cast<long long int>(cx) * GRID_CELL_SIZE;
+                long long int cell_y = static_cast<long long int>(cy) * GRID_CELL_SIZE;
+                long long int dx = std::max({0LL, cell_x - xy.x, xy.x - (cell_x + GRID_CELL_SIZE - 1)});
+                long long int dy = std::max({0LL, cell_y - xy.y, xy.y - (cell_y + GRID_CELL_SIZE - 1)});
+                cells.push_back({dx*dx + dy*dy, &cell.second});
+            }
         }
+        auto heap_order = [](auto const& a, auto const& b){ return a.first > b.first; };
+        std::make_heap(cells.begin(), cells.end(), heap_order);
+        while (!cells.empty() and (closest.size() < max_places or cells.front().first <= closest.back().distance)){
+            std::pop_heap(cells.begin(), cells.end(), heap_order);
+            check_places(*cells.back().second);
+            cells.pop_back();
+        }
+    }
+
+    std::vector<PlaceID> id_close_places;
+    for (auto& i : closest){
+        id_close_places.push_back(i.id);
     }
     return {id_close_places};
 }
 
 bool Datastructures::remove_place(PlaceID id)
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
 
     if ( places_.find(id) == places_.end() ) {
         return false;
@@ -362,188 +957,388 @@ bool Datastructures::remove_place(PlaceID id)
 
     std::unordered_map<PlaceID, place>::iterator it;
     it = places_.find(id);
+    places_by_name_.erase(it->second.name_it);
+    grid_erase(id, it->second.place_type, it->second.coord);
+    places_by_coord_.erase(it->second.coord_it);
+
+    // Move the last id of the bucket into the removed slot
+    auto& bucket = places_by_type_[static_cast<std::size_t>(it->second.place_type)];
+    PlaceID moved_id = bucket.back();
+    bucket[it->second.type_index] = moved_id;
+    places_.at(moved_id).type_index = it->second.type_index;
+    bucket.pop_back();
+
     places_.erase(it);
+    mark_place_changed(id);
     return true;
 }
 
 std::vector<AreaID> Datastructures::all_subareas_in_area(AreaID id)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if(areas_.find(id) == areas_.end()){
+    auto it = areas_.find(id);
+    if(it == areas_.end()){
         return {NO_AREA};
     }
 
-    sub_areas.clear();
-    check_subareas(id);
-    return sub_areas;
-}
-
-void Datastructures::check_subareas(AreaID id)
-{
-    if (areas_[id].subareas.empty()){
-        return;
-    }
+    ensure_area_index();
 
-    for(auto& sub_area : areas_[id].subareas){
-        sub_areas.push_back(sub_area->id);
-        check_subareas(sub_area->id);
-    }
+    std::size_t index = it->second.index;
+    auto first = area_preorder_.begin() + area_preorder_pos_[index];
+    return std::vector<AreaID>(first + 1, first + area_subtree_size_[index]);
 }
 
 AreaID Datastructures::common_area_of_subareas(AreaID id1, AreaID id2)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if (areas_.find(id1) == areas_.end()) {
+    auto it1 = areas_.find(id1);
+    if (it1 == areas_.end()) {
         return NO_AREA;
     }
 
-    if (areas_.find(id2) == areas_.end()) {
+    auto it2 = areas_.find(id2);
+    if (it2 == areas_.end()) {
         return NO_AREA;
     }
 
-    std::vector<AreaID> sub_areas1 = subarea_in_areas(id1);
-    std::vector<AreaID> sub_areas2 = subarea_in_areas(id2);
-
-    if (sub_areas1.empty()){
-        return NO_AREA;
-    }
-    if (sub_areas2.empty()){
+    // The common area has to be a parent of both areas, so start from the parents
+    if (it1->second.parent_area == nullptr or it2->second.parent_area == nullptr){
         return NO_AREA;
     }
 
-    std::sort(sub_areas1.begin(), sub_areas1.end());
-    std::sort(sub_areas2.begin(), sub_areas2.end());
-    std::vector<AreaID>::iterator iterator1 = sub_areas1.begin();
-    std::vector<AreaID>::iterator iterator2 = sub_areas2.begin();
+    ensure_area_index();
 
-    while(iterator1 != sub_areas1.end() or iterator2 != sub_areas2.end()){
-        if (*iterator1 == *iterator2){
-            return *iterator1;
-        }
-        else if (*iterator1 < *iterator2){
-            iterator1++;
+    std::size_t area1 = it1->second.parent_area->index;
+    std::size_t area2 = it2->second.parent_area->index;
+    if (area_depth_[area1] < area_depth_[area2]){
+        std::swap(area1, area2);
+    }
+
+    // Lift the deeper area to the same depth
+    std::size_t depth_difference = area_depth_[area1] - area_depth_[area2];
+    for (std::size_t k = 0; depth_difference > 0; k++, depth_difference >>= 1){
+        if (depth_difference & 1){
+            area1 = area_ancestors_[k][area1];
         }
-        else if (*iterator1 > *iterator2){
-            iterator2++;
+    }
+
+    if (area1 != area2){
+        for (std::size_t k = area_ancestors_.size(); k-- > 0;){
+            if (area_ancestors_[k][area1] != area_ancestors_[k][area2]){
+                area1 = area_ancestors_[k][area1];
+                area2 = area_ancestors_[k][area2];
+            }
         }
+        area1 = area_ancestors_[0][area1];
+        area2 = area_ancestors_[0][area2];
+    }
+
+    // Areas in different trees end up in different roots
+    if (area1 != area2){
+        return NO_AREA;
     }
-    return NO_AREA;
+    return area_order_[area1]->id;
 }
 
 std::vector<WayID> Datastructures::all_ways()
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
     std::vector<WayID> way_id_list;
 
-    for (auto& way_id : ways_)
-       way_id_list.push_back(way_id.first);
+    way_id_list.reserve(way_handles_.size());
+    for (auto& way_id : way_handles_)
+       way_id_list.push_back(WayID(way_id.first));
 
     return way_id_list;
 }
 
 bool Datastructures::add_way(WayID id, std::vector<Coord> coords)
 {   
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
 
-    struct {
-        Distance operator()(Coord a, Coord b)
-                 //Calculate the distance between two coords
-                const { return sqrt(floor(pow((a.x - b.x), 2)) + floor(pow((a.y - b.y), 2))); }
-    }calculateDistance;
+    Distance distance = way_length(coords);
+    auto record = std::make_shared<way_record const>(way_record{std::move(id), std::move(coords), distance});
 
-    Distance distance = 0;
-    for(unsigned int i = 1; i < coords.size(); i++){
-        distance += calculateDistance(coords[i-1], coords[i]);
-    }
-
-    way new_way = {id, coords, distance};
-    auto insertion_result = ways_.insert({id, new_way});
+    WayHandle handle = free_way_handles_.empty() ? ways_.size() : free_way_handles_.back();
+    auto insertion_result = way_handles_.insert({record->id, handle});
     if (!insertion_result.second){
         return false;
     }
+    if (handle == ways_.size()){
+        ways_.push_back({std::move(record)});
+    }
+    else {
+        free_way_handles_.pop_back();
+        ways_[handle] = {std::move(record)};
+    }
+    ways_trimmed_ = false;
+    ways_distance_ += distance;
+    graph_valid_ = false;
 
-    if(crossroads_.find(coords.front()) == crossroads_.end()) {
-        Crossroad crossroad = {coords.front(), {}};
-        crossroads_.insert({coords.front(), crossroad});
+    if (bulk_loading_){
+        bulk_ways_.push_back(handle);
+    }
+    else {
+        connect_way(handle);
     }
 
-    if(crossroads_.find(coords.back()) == crossroads_.end()) {
-        Crossroad crossroad = {coords.back(), {}};
-        crossroads_.insert({coords.back(), crossroad});
+    return true;
+}
+
+void Datastructures::connect_way(WayHandle handle)
+{
+    Coord front = ways_[handle].record->coords.front();
+    Coord back = ways_[handle].record->coords.back();
+
+    auto front_it = crossroads_.try_emplace(front).first;
+    front_it->second.coords = front;
+    auto back_it = crossroads_.try_emplace(back).first;
+    back_it->second.coords = back;
+
+    front_it->second.connections.push_back({&back_it->second, handle});
+    // A way that starts and ends in the same crossroad is only connected once
+    if (front != back){
+        back_it->second.connections.push_back({&front_it->second, handle});
     }
+}
 
-    crossroads_[coords.front()].connections.push_back({&crossroads_[coords.back()], &ways_[id]});
-    crossroads_[coords.back()].connections.push_back({&crossroads_[coords.front()], &ways_[id]});
+void Datastructures::begin_bulk_load(std::size_t place_count, std::size_t area_count, std::size_t way_count)
+{
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    bulk_loading_ = true;
+
+    places_.reserve(places_.size() + place_count);
+    bulk_places_.reserve(bulk_places_.size() + place_count);
+    areas_.reserve(areas_.size() + area_count);
+    way_handles_.reserve(way_handles_.size() + way_count);
+    ways_.reserve(ways_.size() + way_count);
+    bulk_ways_.reserve(bulk_ways_.size() + way_count);
+}
 
-    return true;
+void Datastructures::end_bulk_load()
+{
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+    bulk_loading_ = false;
 }
 
-std::vector<std::pair<WayID, Coord>> Datastructures::ways_from(Coord xy)
+void Datastructures::flush_bulk_load()
 {
-    std::vector<std::pair<WayID, Coord>> ways_from_coord = {};
+    if (!bulk_places_.empty()){
+        for (auto& [id, place_data] : bulk_places_){
+            index_place(id, *place_data);
+        }
 
-    for (auto& way : ways_){
-        if (way.second.coords.back() == xy){
-            ways_from_coord.push_back({way.first, way.second.coords.front()});
+        // Stable sorts keep places with equal keys in the order they were added, like separate inserts
+        std::stable_sort(bulk_places_.begin(), bulk_places_.end(),
+                         [](auto const& a, auto const& b){ return a.second->name < b.second->name; });
+        for (auto& [id, place_data] : bulk_places_){
+            place_data->name_it = places_by_name_.insert(places_by_name_.end(), std::make_pair(place_data->name, id));
+        }
+        std::stable_sort(bulk_places_.begin(), bulk_places_.end(),
+                         [](auto const& a, auto const& b){ return coord_order_key(a.second->coord) < coord_order_key(b.second->coord); });
+        for (auto& [id, place_data] : bulk_places_){
+            place_data->coord_it = places_by_coord_.insert(places_by_coord_.end(), std::make_pair(coord_order_key(place_data->coord), id));
         }
-        else if (way.second.coords.front() == xy){
-            ways_from_coord.push_back({way.first, way.second.coords.back()});
+        bulk_places_ = {};
+    }
+
+    if (!bulk_ways_.empty()){
+        crossroads_.reserve(crossroads_.size() + bulk_ways_.size());
+        for (WayHandle handle : bulk_ways_){
+            connect_way(handle);
         }
+        bulk_ways_ = {};
+        // A query during the bulk load may have built the graph without these ways
+        graph_valid_ = false;
+    }
+}
+
+std::vector<std::pair<WayID, Coord>> Datastructures::ways_from(Coord xy)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    auto it = crossroads_.find(xy);
+    if (it == crossroads_.end()){
+        return {};
+    }
+
+    std::vector<std::pair<WayID, Coord>> ways_from_coord;
+    ways_from_coord.reserve(it->second.connections.size());
+    for (auto& connection : it->second.connections){
+        ways_from_coord.push_back({ways_[connection.second].record->id, connection.first->coords});
     }
     return ways_from_coord;
 }
 
 std::vector<Coord> Datastructures::get_way_coords(WayID id)
 {
-    if (ways_.find(id) == ways_.end()){
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    auto it = way_handles_.find(id);
+    if (it == way_handles_.end()){
         return {NO_COORD};
     }
-    return ways_.at(id).coords;
+    return ways_[it->second].record->coords;
 }
 
 void Datastructures::clear_ways()
 {
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    erase_ways();
+}
+
+void Datastructures::erase_ways()
+{
+    way_handles_.clear();
     ways_.clear();
+    free_way_handles_.clear();
     crossroads_.clear();
+    bulk_ways_.clear();
+    ways_trimmed_ = false;
+    ways_distance_ = 0;
+    graph_valid_ = false;
+}
+
+void Datastructures::build_graph()
+{
+    std::size_t crossroad_count = crossroads_.size();
+
+    // A new graph is built every time, published snapshots may still share the previous one
+    auto graph = std::make_shared<route_graph>();
+
+    std::vector<Crossroad*> crossroad_list;
+    crossroad_list.reserve(crossroad_count);
+    graph->coords.reserve(crossroad_count);
+    graph->ids.reserve(crossroad_count);
+    for (auto& crossroad : crossroads_){
+        crossroad.second.id = crossroad_list.size();
+        graph->ids.insert({crossroad.first, crossroad.second.id});
+        crossroad_list.push_back(&crossroad.second);
+        graph->coords.push_back(crossroad.first);
+    }
+
+    // Edges keep the order of the connections, so searches visit crossroads in the same order
+    graph->offsets.reserve(crossroad_count + 1);
+    for (auto crossroad : crossroad_list){
+        for (auto& connection : crossroad->connections){
+            graph->targets.push_back(connection.first->id);
+            graph->weights.push_back(ways_[connection.second].record->distance);
+            graph->edge_ways.push_back(connection.second);
+        }
+        graph->offsets.push_back(graph->targets.size());
+    }
+
+    graph->ways.reserve(ways_.size());
+    for (auto& way : ways_){
+        graph->ways.push_back(way.record);
+    }
+
+    graph_ = std::move(graph);
+    graph_valid_ = true;
+}
+
+Datastructures::route_graph const& Datastructures::ensure_graph()
+{
+    if (!graph_valid_){
+        std::lock_guard<std::mutex> build_lock(index_mutex_);
+        if (!graph_valid_){
+            build_graph();
+        }
+    }
+    return *graph_;
+}
+
+std::unique_ptr<Datastructures::search_context> Datastructures::search_pool::acquire()
+{
+    std::lock_guard<std::mutex> pool_lock(mutex);
+    if (contexts.empty()){
+        return std::make_unique<search_context>();
+    }
+    std::unique_ptr<search_context> context = std::move(contexts.back());
+    contexts.pop_back();
+    return context;
+}
+
+void Datastructures::search_pool::release(std::unique_ptr<search_context> context)
+{
+    std::lock_guard<std::mutex> pool_lock(mutex);
+    contexts.push_back(std::move(context));
+}
+
+void Datastructures::start_search(std::size_t crossroad_count, search_context& context)
+{
+    if (context.state.size() < crossroad_count){
+        context.state.resize(crossroad_count);
+    }
+
+    context.epoch++;
+    // After a wrap-around old stamps could match again, so they are cleared once
+    if (context.epoch == 0){
+        for (auto& state : context.state){
+            state.epoch = 0;
+        }
+        context.epoch = 1;
+    }
+}
+
+Datastructures::search_node& Datastructures::touch(search_context& context, std::uint32_t crossroad)
+{
+    search_node& state = context.state[crossroad];
+    if (state.epoch != context.epoch){
+        state = {};
+        state.epoch = context.epoch;
+    }
+    return state;
 }
 
 std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_any(Coord fromxy, Coord toxy)
 {
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
 
-    if(crossroads_.find(fromxy) == crossroads_.end() or crossroads_.find(toxy) == crossroads_.end()){
+    route_graph const& graph = ensure_graph();
+    std::uint32_t target = graph.find(fromxy);
+    std::uint32_t starting_point = graph.find(toxy);
+    if(target == NO_NODE or starting_point == NO_NODE){
         return {{NO_COORD, NO_WAY, NO_DISTANCE}};
     }
 
-    for (auto& crossroad : crossroads_){
-        crossroad.second.last_crossroad = nullptr;
-        crossroad.second.colour = W;
-    }
+    search_lease lease(searches_);
+    search_context& context = *lease;
+    start_search(graph.size(), context);
 
-    Crossroad* starting_point = &crossroads_[toxy];
-    std::stack<Crossroad*> stack;
-    Crossroad* uu;
-    Crossroad* end_point;
-    stack.push(starting_point);
+    touch(context, starting_point);
+    std::vector<std::uint32_t>& stack = context.any_stack;
+    stack.clear();
+    std::uint32_t uu;
+    std::uint32_t end_point = NO_NODE;
+    stack.push_back(starting_point);
     bool r_found = false;
 
     while (stack.empty() != true and r_found == false){
-        uu = stack.top();
-        stack.pop();
-        if(uu->colour == W){
-            uu->colour = G;
-            stack.push(uu);
-            for (auto& vv : uu->connections){
-                if (vv.first->colour == W){
-                    vv.first->last_crossroad = uu;
-                    stack.push(vv.first);
-                    if (vv.first->coords == fromxy){
+        uu = stack.back();
+        stack.pop_back();
+        search_node& uu_state = context.state[uu];
+        if(uu_state.colour == W){
+            uu_state.colour = G;
+            stack.push_back(uu);
+            for (std::uint32_t edge = graph.offsets[uu]; edge < graph.offsets[uu+1]; edge++){
+                std::uint32_t vv = graph.targets[edge];
+                search_node& vv_state = touch(context, vv);
+                if (vv_state.colour == W){
+                    vv_state.last = uu;
+                    vv_state.last_edge = edge;
+                    stack.push_back(vv);
+                    if (vv == target){
                         r_found = true;
-                        end_point = vv.first;
+                        end_point = vv;
                         break;
                     }
                 }
             }
         }
         else {
-            uu->colour = B;
+            uu_state.colour = B;
         }
     }
     if (r_found == false){
@@ -551,85 +1346,1079 @@ std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_any(Coord
     }
 
     Distance distance = 0;
-    way* connecting_way;
     std::vector<std::tuple<Coord, WayID, Distance>> route;
     route.push_back({fromxy, NO_WAY, distance});
-    while (end_point->coords != toxy){
-        for (auto& connection : end_point->connections){
-            if (connection.first == end_point->last_crossroad){
-                connecting_way = connection.second;
+    while (end_point != starting_point){
+        distance += graph.weights[context.state[end_point].last_edge];
+
+        end_point = context.state[end_point].last;
+        route.push_back({graph.coords[end_point], NO_WAY, distance});
+    }
+    return route;
+}
+
+bool Datastructures::remove_way(WayID id)
+{
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+
+    auto it = way_handles_.find(id);
+    if ( it == way_handles_.end() ) {
+        return false;
+    }
+
+    WayHandle handle = it->second;
+    way& way = ways_[handle];
+
+    for (Coord end_coord : {way.record->coords.front(), way.record->coords.back()}){
+        auto crossroad = crossroads_.find(end_coord);
+        if (crossroad == crossroads_.end()){
+            continue;
+        }
+        auto& connections = crossroad->second.connections;
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [handle](auto const& connection){ return connection.second == handle; }),
+                          connections.end());
+        if (connections.empty()){
+            crossroads_.erase(crossroad);
+        }
+    }
+
+    // The key of way_handles_ views the id in the record, so the key goes first
+    ways_distance_ -= way.record->distance;
+    way_handles_.erase(it);
+    way = {};
+    free_way_handles_.push_back(handle);
+    graph_valid_ = false;
+    return true;
+}
+
+std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_least_crossroads(Coord fromxy, Coord toxy)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    search_lease lease(searches_);
+    return least_crossroads_route(ensure_graph(), *lease, fromxy, toxy);
+}
+
+template <typename Graph>
+std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::least_crossroads_route(Graph const& graph, search_context& context, Coord fromxy, Coord toxy)
+{
+    std::uint32_t starting_point = graph.find(fromxy);
+    std::uint32_t end_point = graph.find(toxy);
+    if(starting_point == NO_NODE or end_point == NO_NODE){
+        return {{NO_COORD, NO_WAY, NO_DISTANCE}};
+    }
+
+    if (fromxy == toxy){
+        return {{fromxy, NO_WAY, 0}};
+    }
+
+    start_search(graph.size(), context);
+
+    // Forward search from fromxy and backward search from toxy, the smaller frontier is expanded
+    // one whole level at a time. The best meeting connection found during a level is the middle
+    // of a route with least crossroads.
+    touch(context, starting_point).hops = 0;
+    touch(context, end_point).back_hops = 0;
+    context.frontier.assign(1, starting_point);
+    context.back_frontier.assign(1, end_point);
+
+    int best_hops = std::numeric_limits<int>::max();
+    std::uint32_t meet_from = NO_NODE;
+    std::uint32_t meet_to = NO_NODE;
+    std::uint32_t meet_edge = NO_NODE;
+
+    while (meet_edge == NO_NODE and !context.frontier.empty() and !context.back_frontier.empty()){
+        context.next_frontier.clear();
+        if (context.frontier.size() <= context.back_frontier.size()){
+            for (auto uu : context.frontier){
+                int uu_hops = context.state[uu].hops;
+                for (std::uint32_t edge = graph.offsets[uu]; edge < graph.offsets[uu+1]; edge++){
+                    std::uint32_t vv = graph.targets[edge];
+                    search_node& vv_state = touch(context, vv);
+                    if (vv_state.back_hops != -1 and uu_hops + 1 + vv_state.back_hops < best_hops){
+                        best_hops = uu_hops + 1 + vv_state.back_hops;
+                        meet_from = uu;
+                        meet_to = vv;
+                        meet_edge = edge;
+                    }
+                    if (vv_state.hops == -1){
+                        vv_state.hops = uu_hops + 1;
+                        vv_state.last = uu;
+                        vv_state.last_edge = edge;
+                        context.next_frontier.push_back(vv);
+                    }
+                }
             }
+            context.frontier.swap(context.next_frontier);
         }
-        distance += connecting_way->distance;
+        else {
+            for (auto uu : context.back_frontier){
+                int uu_back_hops = context.state[uu].back_hops;
+                for (std::uint32_t edge = graph.offsets[uu]; edge < graph.offsets[uu+1]; edge++){
+                    std::uint32_t vv = graph.targets[edge];
+                    search_node& vv_state = touch(context, vv);
+                    if (vv_state.hops != -1 and vv_state.hops + 1 + uu_back_hops < best_hops){
+                        best_hops = vv_state.hops + 1 + uu_back_hops;
+                        meet_from = vv;
+                        meet_to = uu;
+                        meet_edge = edge;
+                    }
+                    if (vv_state.back_hops == -1){
+                        vv_state.back_hops = uu_back_hops + 1;
+                        vv_state.next = uu;
+                        vv_state.next_edge = edge;
+                        context.next_frontier.push_back(vv);
+                    }
+                }
+            }
+            context.back_frontier.swap(context.next_frontier);
+        }
+    }
+
+    if (meet_edge == NO_NODE){
+        return {};
+    }
+
+    // Forward half is read backwards from the meeting point and then reversed
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> steps;
+    steps.push_back({meet_from, meet_edge});
+    for (std::uint32_t current = meet_from; current != starting_point; current = context.state[current].last){
+        steps.push_back({context.state[current].last, context.state[current].last_edge});
+    }
+    std::reverse(steps.begin(), steps.end());
+    for (std::uint32_t current = meet_to; current != end_point; current = context.state[current].next){
+        steps.push_back({current, context.state[current].next_edge});
+    }
 
-        end_point = end_point->last_crossroad;
-        route.push_back({end_point->coords, NO_WAY, distance});
+    std::vector<std::tuple<Coord, WayID, Distance>> route;
+    route.reserve(steps.size() + 1);
+    Distance distance = 0;
+    for (auto& step : steps){
+        route.push_back({graph.coords[step.first], graph.way_id(graph.edge_ways[step.second]), distance});
+        distance += graph.weights[step.second];
     }
+    route.push_back({toxy, NO_WAY, distance});
     return route;
 }
 
-bool Datastructures::remove_way(WayID id)
+std::vector<std::tuple<Coord, WayID> > Datastructures::route_with_cycle(Coord fromxy)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+
+    route_graph const& graph = ensure_graph();
+    std::uint32_t starting_point = graph.find(fromxy);
+    if(starting_point == NO_NODE){
+        return {{NO_COORD, NO_WAY}};
+    }
+
+    search_lease lease(searches_);
+    search_context& context = *lease;
+    start_search(graph.size(), context);
+
+    // Gray crossroads are the ones on the current DFS path, so reaching a gray crossroad
+    // along some other way than the one used to arrive closes a cycle
+    std::uint32_t cycle_start = NO_NODE;
+    std::uint32_t cycle_end = NO_NODE;
+    std::uint32_t cycle_edge = NO_NODE;
+
+    context.stack.clear();
+    touch(context, starting_point).colour = G;
+    context.stack.push_back({starting_point, graph.offsets[starting_point]});
+
+    while (!context.stack.empty()){
+        std::uint32_t uu = context.stack.back().first;
+        std::uint32_t edge = context.stack.back().second;
+        search_node& uu_state = context.state[uu];
+        if (edge == graph.offsets[uu+1]){
+            uu_state.colour = B;
+            context.stack.pop_back();
+            continue;
+        }
+        context.stack.back().second++;
+
+        if (uu_state.last_edge != NO_NODE and graph.edge_ways[edge] == graph.edge_ways[uu_state.last_edge]){
+            continue;
+        }
+        std::uint32_t vv = graph.targets[edge];
+        search_node& vv_state = touch(context, vv);
+        if (vv_state.colour == G){
+            cycle_start = uu;
+            cycle_end = vv;
+            cycle_edge = edge;
+            break;
+        }
+        if (vv_state.colour == W){
+            vv_state.colour = G;
+            vv_state.last = uu;
+            vv_state.last_edge = edge;
+            context.stack.push_back({vv, graph.offsets[vv]});
+        }
+    }
+
+    if (cycle_edge == NO_NODE){
+        return {};
+    }
+
+    std::vector<std::tuple<Coord, WayID>> route;
+    route.push_back({graph.coords[cycle_end], NO_WAY});
+    route.push_back({graph.coords[cycle_start], graph.way_id(graph.edge_ways[cycle_edge])});
+    for (std::uint32_t current = cycle_start; current != starting_point; current = context.state[current].last){
+        route.push_back({graph.coords[context.state[current].last],
+                         graph.way_id(graph.edge_ways[context.state[current].last_edge])});
+    }
+    std::reverse(route.begin(), route.end());
+    return route;
+}
+
+std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_shortest_distance(Coord fromxy, Coord toxy)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    search_lease lease(searches_);
+    return shortest_distance_route(ensure_graph(), *lease, fromxy, toxy);
+}
+
+template <typename Graph>
+std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::shortest_distance_route(Graph const& graph, search_context& context, Coord fromxy, Coord toxy)
+{
+    // Search is done from toxy to fromxy so that the route can be read forward from fromxy
+    std::uint32_t starting_point = graph.find(toxy);
+    std::uint32_t end_point = graph.find(fromxy);
+    if(starting_point == NO_NODE or end_point == NO_NODE){
+        return {{NO_COORD, NO_WAY, NO_DISTANCE}};
+    }
+
+    start_search(graph.size(), context);
+
+    // Integer coordinates make every truncated way segment at least 1/sqrt(2) of its real length,
+    // so this estimate never exceeds the remaining distance
+    struct {
+        Distance operator()(Coord a, Coord b)
+                const { return std::hypot(double(a.x) - b.x, double(a.y) - b.y) / std::sqrt(2.0); }
+    }estimate;
+
+    auto heap_order = [](auto const& a, auto const& b){ return std::get<0>(a) > std::get<0>(b); };
+
+    context.heap.clear();
+    search_node& start_state = touch(context, starting_point);
+    touch(context, end_point);
+    start_state.distance = 0;
+    start_state.colour = G;
+    context.heap.push_back({estimate(toxy, fromxy), 0, starting_point});
+
+    while (!context.heap.empty()){
+        std::pop_heap(context.heap.begin(), context.heap.end(), heap_order);
+        auto [estimated, distance, uu] = context.heap.back();
+        context.heap.pop_back();
+
+        search_node& uu_state = context.state[uu];
+        if (uu_state.colour == B or distance > uu_state.distance){
+            continue;
+        }
+        uu_state.colour = B;
+        if (uu == end_point){
+            break;
+        }
+
+        for (std::uint32_t edge = graph.offsets[uu]; edge < graph.offsets[uu+1]; edge++){
+            std::uint32_t vv = graph.targets[edge];
+            search_node& vv_state = touch(context, vv);
+            Distance new_distance = distance + graph.weights[edge];
+            if (vv_state.colour == W or (vv_state.colour == G and new_distance < vv_state.distance)){
+                vv_state.colour = G;
+                vv_state.distance = new_distance;
+                vv_state.last = uu;
+                vv_state.last_edge = edge;
+                context.heap.push_back({new_distance + estimate(graph.coords[vv], fromxy), new_distance, vv});
+                std::push_heap(context.heap.begin(), context.heap.end(), heap_order);
+            }
+        }
+    }
+
+    if (context.state[end_point].colour != B){
+        return {};
+    }
+
+    std::vector<std::tuple<Coord, WayID, Distance>> route;
+    Distance distance = 0;
+    while (end_point != starting_point){
+        std::uint32_t edge = context.state[end_point].last_edge;
+        route.push_back({graph.coords[end_point], graph.way_id(graph.edge_ways[edge]), distance});
+        distance += graph.weights[edge];
+        end_point = context.state[end_point].last;
+    }
+    route.push_back({graph.coords[end_point], NO_WAY, distance});
+    return route;
+}
+
+std::vector<std::vector<std::tuple<Coord, WayID, Distance> > > Datastructures::route_shortest_distance_batch(std::vector<std::pair<Coord, Coord> > const& queries)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    return route_batch(queries, &Datastructures::shortest_distance_route<route_graph>);
+}
+
+std::vector<std::vector<std::tuple<Coord, WayID, Distance> > > Datastructures::route_least_crossroads_batch(std::vector<std::pair<Coord, Coord> > const& queries)
+{
+    std::shared_lock<std::shared_mutex> lock(data_mutex_);
+    return route_batch(queries, &Datastructures::least_crossroads_route<route_graph>);
+}
+
+std::vector<std::vector<std::tuple<Coord, WayID, Distance> > > Datastructures::route_batch(std::vector<std::pair<Coord, Coord> > const& queries, route_engine engine)
+{
+    std::vector<std::vector<std::tuple<Coord, WayID, Distance>>> routes(queries.size());
+    if (queries.empty()){
+        return routes;
+    }
+
+    // The snapshot is built before the workers start, after that they only read it
+    route_graph const& graph = ensure_graph();
+
+    // Workers take the next query from a shared counter, so long searches do not hold up the others.
+    // Once a search has failed the remaining queries are skipped.
+    std::atomic<std::size_t> next_query{0};
+    std::atomic<bool> failed{false};
+    batch_workers_.run([&](){
+        if (next_query >= queries.size()){
+            return;
+        }
+        try {
+            search_lease lease(searches_);
+            for (std::size_t i = next_query++; i < queries.size() and !failed; i = next_query++){
+                routes[i] = engine(graph, *lease, queries[i].first, queries[i].second);
+            }
+        }
+        catch (...){
+            failed = true;
+            throw;
+        }
+    });
+    return routes;
+}
+
+Datastructures::worker_pool::~worker_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_){
+        thread.join();
+    }
+}
+
+void Datastructures::worker_pool::run(std::function<void()> const& job)
+{
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (threads_.empty()){
+            // The calling thread is one of the workers
+            std::size_t thread_count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+            threads_.reserve(thread_count);
+            for (std::size_t i = 0; i < thread_count; ++i){
+                threads_.emplace_back(&worker_pool::work, this);
+            }
+        }
+        job_ = &job;
+        error_ = nullptr;
+        running_ = threads_.size();
+        batch_++;
+    }
+    start_.notify_all();
+
+    run_job(job);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this](){ return running_ == 0; });
+    job_ = nullptr;
+    if (error_){
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void Datastructures::worker_pool::work()
+{
+    std::size_t seen_batch = 0;
+    while (true){
+        std::function<void()> const* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [this, seen_batch](){ return stopping_ or batch_ != seen_batch; });
+            if (stopping_){
+                return;
+            }
+            seen_batch = batch_;
+            job = job_;
+        }
+
+        run_job(*job);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--running_ == 0){
+            done_.notify_all();
+        }
+    }
+}
+
+void Datastructures::worker_pool::run_job(std::function<void()> const& job)
+{
+    try {
+        job();
+    }
+    catch (...){
+        // The first exception is kept, the others would only repeat it
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_){
+            error_ = std::current_exception();
+        }
+    }
+}
+
+template <typename Graph>
+std::vector<std::pair<WayID, Coord>> Datastructures::graph_ways_from(Graph const& graph, Coord xy)
+{
+    std::uint32_t crossroad = graph.find(xy);
+    if (crossroad == NO_NODE){
+        return {};
+    }
+
+    std::vector<std::pair<WayID, Coord>> ways_from_coord;
+    ways_from_coord.reserve(graph.offsets[crossroad+1] - graph.offsets[crossroad]);
+    for (std::uint32_t edge = graph.offsets[crossroad]; edge < graph.offsets[crossroad+1]; edge++){
+        ways_from_coord.push_back({graph.way_id(graph.edge_ways[edge]), graph.coords[graph.targets[edge]]});
+    }
+    return ways_from_coord;
+}
+
+Distance Datastructures::trim_ways()
+{
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+    if (ways_trimmed_){
+        return ways_distance_;
+    }
+
+    if (!graph_valid_){
+        build_graph();
+    }
+    route_graph const& graph = *graph_;
+
+    std::vector<std::uint32_t> set_parent(graph.coords.size());
+    std::vector<std::uint32_t> set_size(graph.coords.size(), 1);
+    for (std::uint32_t i = 0; i < set_parent.size(); i++){
+        set_parent[i] = i;
+    }
+
+    auto find_set = [&set_parent](std::uint32_t item){
+        std::uint32_t root = item;
+        while (set_parent[root] != root){
+            root = set_parent[root];
+        }
+        while (set_parent[item] != root){
+            std::uint32_t next = set_parent[item];
+            set_parent[item] = root;
+            item = next;
+        }
+        return root;
+    };
+
+    // Every way once as (way, crossroad, crossroad), taken from the edge of its smaller end
+    std::vector<std::tuple<WayHandle, std::uint32_t, std::uint32_t>> sorted_ways;
+    sorted_ways.reserve(way_handles_.size());
+    for (std::uint32_t uu = 0; uu + 1 < graph.offsets.size(); uu++){
+        for (std::uint32_t edge = graph.offsets[uu]; edge < graph.offsets[uu+1]; edge++){
+            if (uu <= graph.targets[edge]){
+                sorted_ways.push_back({graph.edge_ways[edge], uu, graph.targets[edge]});
+            }
+        }
+    }
+    std::sort(sorted_ways.begin(), sorted_ways.end(), [this](auto const& a, auto const& b){
+        way_record const& way_a = *ways_[std::get<0>(a)].record;
+        way_record const& way_b = *ways_[std::get<0>(b)].record;
+        return way_a.distance < way_b.distance or (way_a.distance == way_b.distance and way_a.id < way_b.id); });
+
+    // Kruskal: a way is kept only if it joins two separate parts of the forest
+    Distance remaining_distance = 0;
+    bool ways_removed = false;
+    for (auto [handle, crossroad1, crossroad2] : sorted_ways){
+        std::uint32_t set1 = find_set(crossroad1);
+        std::uint32_t set2 = find_set(crossroad2);
+        if (set1 == set2){
+            ways_[handle].trimmed = true;
+            ways_removed = true;
+            continue;
+        }
+        if (set_size[set1] < set_size[set2]){
+            std::swap(set1, set2);
+        }
+        set_parent[set2] = set1;
+        set_size[set1] += set_size[set2];
+        remaining_distance += ways_[handle].record->distance;
+    }
+
+    // Trimmed ways are removed in bulk: first from the connections (crossroads that are left
+    // without connections go at the same time), then the ways themselves
+    for (auto it = crossroads_.begin(); it != crossroads_.end();){
+        auto& connections = it->second.connections;
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [this](auto const& connection){ return ways_[connection.second].trimmed; }),
+                          connections.end());
+        if (connections.empty()){
+            it = crossroads_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    for (auto it = way_handles_.begin(); it != way_handles_.end();){
+        if (ways_[it->second].trimmed){
+            WayHandle handle = it->second;
+            it = way_handles_.erase(it);
+            ways_[handle] = {};
+            free_way_handles_.push_back(handle);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    if (ways_removed){
+        graph_valid_ = false;
+    }
+    ways_trimmed_ = true;
+    ways_distance_ = remaining_distance;
+    return remaining_distance;
+}
+
+bool Datastructures::save_snapshot(std::string const& filename)
 {
+    // Places and ways of an unfinished bulk load are not in the indexes and crossroads yet
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+
+    snapshot_writer writer;
+    writer.buffer.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writer.put<std::uint32_t>(SNAPSHOT_VERSION);
+
+    // Places in name order, so places with the same name keep their order after loading
+    writer.put<std::uint64_t>(places_.size());
+    for (auto& name : places_by_name_){
+        place const& place_data = places_.at(name.second);
+        writer.put<std::int64_t>(name.second);
+        writer.put_string(place_data.name);
+        writer.put<std::uint8_t>(static_cast<std::uint8_t>(place_data.place_type));
+        writer.put_coord(place_data.coord);
+    }
+
+    writer.put<std::uint64_t>(areas_.size());
+    std::size_t link_count = 0;
+    for (auto& area_data : areas_){
+        writer.put<std::int64_t>(area_data.first);
+        writer.put_string(area_data.second.name);
+        writer.put_coords(area_data.second.coords);
+        link_count += area_data.second.subareas.size();
+    }
+    // Links in the order of the subarea lists, so the lists are rebuilt in the same order
+    writer.put<std::uint64_t>(link_count);
+    for (auto& area_data : areas_){
+        for (area* sub_area : area_data.second.subareas){
+            writer.put<std::int64_t>(sub_area->id);
+            writer.put<std::int64_t>(area_data.first);
+        }
+    }
+
+    // Ways are numbered in the order they are written, crossroads refer to them by that number
+    std::vector<std::uint32_t> way_numbers(ways_.size());
+    writer.put<std::uint64_t>(way_handles_.size());
+    std::uint32_t way_number = 0;
+    for (WayHandle handle = 0; handle < ways_.size(); handle++){
+        if (ways_[handle].record == nullptr){
+            continue;
+        }
+        way_numbers[handle] = way_number++;
+        writer.put_string(ways_[handle].record->id);
+        writer.put_coords(ways_[handle].record->coords);
+    }
 
-    std::unordered_map<WayID, way>::iterator it;
-    it = ways_.find(id);
-    if ( it == ways_.end() ) {
+    writer.put<std::uint64_t>(crossroads_.size());
+    for (auto& crossroad : crossroads_){
+        writer.put_coord(crossroad.first);
+        writer.put<std::uint32_t>(crossroad.second.connections.size());
+        for (auto& connection : crossroad.second.connections){
+            writer.put<std::uint32_t>(way_numbers[connection.second]);
+        }
+    }
+
+    std::ofstream output(filename, std::ios::binary);
+    output.write(writer.buffer.data(), writer.buffer.size());
+    return static_cast<bool>(output);
+}
+
+bool Datastructures::load_snapshot(std::string const& filename)
+{
+    std::ifstream input(filename, std::ios::binary);
+    if (!input){
+        return false;
+    }
+    std::string buffer{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+
+    snapshot_reader reader{buffer.data(), buffer.data() + buffer.size()};
+    if (buffer.size() < sizeof(SNAPSHOT_MAGIC) or std::memcmp(buffer.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0){
+        return false;
+    }
+    reader.pos += sizeof(SNAPSHOT_MAGIC);
+    if (reader.get<std::uint32_t>() != SNAPSHOT_VERSION){
         return false;
     }
 
-    auto first_coord = ways_.at(id).coords.front();
-    auto last_coord = ways_.at(id).coords.back();
+    // Everything is decoded and checked before the current data is replaced
+    struct place_item{
+        PlaceID id;
+        Name name;
+        PlaceType type;
+        Coord coord;
+    };
+    std::vector<place_item> place_items(reader.get_count(21));
+    for (auto& item : place_items){
+        item.id = reader.get<std::int64_t>();
+        item.name = reader.get_string();
+        std::uint8_t type = reader.get<std::uint8_t>();
+        item.type = static_cast<PlaceType>(type);
+        item.coord = reader.get_coord();
+        if (type > static_cast<std::uint8_t>(PlaceType::NO_TYPE)){
+            reader.ok = false;
+        }
+    }
 
-    way* way =  &ways_.at(id);
-    Crossroad starting_point = crossroads_.at(first_coord);
-    Crossroad end_point = crossroads_.at(last_coord);
+    struct area_item{
+        AreaID id;
+        Name name;
+        std::vector<Coord> coords;
+    };
+    std::vector<area_item> area_items(reader.get_count(16));
+    for (auto& item : area_items){
+        item.id = reader.get<std::int64_t>();
+        item.name = reader.get_string();
+        item.coords = reader.get_coords();
+    }
+    std::vector<std::pair<AreaID, AreaID>> links(reader.get_count(16));
+    for (auto& link : links){
+        link.first = reader.get<std::int64_t>();
+        link.second = reader.get<std::int64_t>();
+    }
 
-    for (auto connection : starting_point.connections){
-        if (connection.second == way){
-            starting_point.connections.erase(std::remove(starting_point.connections.begin(),
-                                                         starting_point.connections.end(), connection),
-                                             starting_point.connections.end());
+    std::unordered_map<std::string_view, WayHandle> way_handles;
+    std::vector<way> ways(reader.get_count(8));
+    way_handles.reserve(ways.size());
+    Distance ways_distance = 0;
+    for (WayHandle handle = 0; handle < ways.size() and reader.ok; handle++){
+        way_record way_data;
+        way_data.id = reader.get_string();
+        way_data.coords = reader.get_coords();
+        way_data.distance = way_length(way_data.coords);
+        ways_distance += way_data.distance;
+        ways[handle].record = std::make_shared<way_record const>(std::move(way_data));
+        if (ways[handle].record->coords.empty() or !way_handles.insert({ways[handle].record->id, handle}).second){
+            reader.ok = false;
         }
     }
 
-    for (auto connection : end_point.connections){
-        if (connection.second == way){
-            end_point.connections.erase(std::remove(end_point.connections.begin(),
-                                                         end_point.connections.end(), connection),
-                                             end_point.connections.end());
+    // Crossroads are created first and connected when all of them exist. A connection leads to
+    // the other end of its way, which has to be a crossroad too.
+    std::unordered_map<Coord, Crossroad, CoordHash> crossroads;
+    std::size_t crossroad_count = reader.get_count(12);
+    crossroads.reserve(crossroad_count);
+    std::vector<std::pair<Crossroad*, std::vector<WayHandle>>> connection_lists;
+    connection_lists.reserve(crossroad_count);
+    for (std::size_t i = 0; i < crossroad_count and reader.ok; i++){
+        Coord xy = reader.get_coord();
+        std::vector<WayHandle> handles(reader.get_count<std::uint32_t>(4));
+        for (auto& handle : handles){
+            handle = reader.get<std::uint32_t>();
+        }
+        auto insertion_result = crossroads.insert({xy, {xy, {}}});
+        if (!insertion_result.second){
+            reader.ok = false;
+        }
+        connection_lists.push_back({&insertion_result.first->second, std::move(handles)});
+    }
+    for (auto& [crossroad, handles] : connection_lists){
+        if (!reader.ok){
+            break;
+        }
+        crossroad->connections.reserve(handles.size());
+        for (WayHandle handle : handles){
+            if (handle >= ways.size()){
+                reader.ok = false;
+                break;
+            }
+            Coord front = ways[handle].record->coords.front();
+            Coord back = ways[handle].record->coords.back();
+            auto target = crossroads.find(front == crossroad->coords ? back : front);
+            if ((front != crossroad->coords and back != crossroad->coords) or target == crossroads.end()){
+                reader.ok = false;
+                break;
+            }
+            crossroad->connections.push_back({&target->second, handle});
         }
     }
+    if (!reader.ok or reader.pos != reader.end){
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    erase_places_areas();
+    erase_ways();
 
-    ways_.erase(it);
-    if (starting_point.connections.empty()){
-        crossroads_.erase(starting_point.coords);
+    places_.reserve(place_items.size());
+    for (auto& item : place_items){
+        insert_place(item.id, item.name, item.type, item.coord);
     }
-    if (end_point.connections.empty()){
-        crossroads_.erase(end_point.coords);
+    areas_.reserve(area_items.size());
+    for (auto& item : area_items){
+        insert_area(item.id, item.name, std::move(item.coords));
     }
+    for (auto& link : links){
+        link_subarea(link.first, link.second);
+    }
+
+    // Moving the crossroad map keeps its nodes, so the connection pointers stay valid
+    way_handles_ = std::move(way_handles);
+    ways_ = std::move(ways);
+    crossroads_ = std::move(crossroads);
+    ways_distance_ = ways_distance;
     return true;
 }
 
-std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_least_crossroads(Coord fromxy, Coord toxy)
+// Entry of the place table in the graph file, the name is in the text section
+struct Datastructures::mapped_graph::place_entry
 {
-    // Replace this comment with your implementation
-    return {{NO_COORD, NO_WAY, NO_DISTANCE}};
+    std::int64_t id;
+    Coord coord;
+    std::uint32_t name_offset;
+    std::uint32_t name_length;
+    std::uint32_t type;
+    std::uint32_t unused;
+};
+
+bool Datastructures::save_graph_file(std::string const& filename)
+{
+    // Ways of an unfinished bulk load are not connected into crossroads_ yet, so the graph would miss them
+    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+    flush_bulk_load();
+    route_graph const& graph = ensure_graph();
+
+    // Ways are renumbered densely in handle order, the gaps of removed ways are left out
+    std::vector<WayHandle> way_numbers(ways_.size());
+    std::vector<std::uint32_t> way_id_offsets = {0};
+    std::string text;
+    for (WayHandle handle = 0; handle < ways_.size(); handle++){
+        if (ways_[handle].record == nullptr){
+            continue;
+        }
+        way_numbers[handle] = way_id_offsets.size() - 1;
+        text += ways_[handle].record->id;
+        way_id_offsets.push_back(text.size());
+    }
+    std::vector<WayHandle> edge_ways;
+    edge_ways.reserve(graph.edge_ways.size());
+    for (WayHandle handle : graph.edge_ways){
+        edge_ways.push_back(way_numbers[handle]);
+    }
+
+    std::vector<std::uint32_t> coord_order(graph.size());
+    for (std::uint32_t i = 0; i < coord_order.size(); i++){
+        coord_order[i] = i;
+    }
+    std::sort(coord_order.begin(), coord_order.end(),
+              [&graph](std::uint32_t a, std::uint32_t b){ return graph.coords[a] < graph.coords[b]; });
+
+    std::vector<mapped_graph::place_entry> places;
+    places.reserve(places_.size());
+    for (auto& place_data : places_){
+        places.push_back({place_data.first, place_data.second.coord, static_cast<std::uint32_t>(text.size()),
+                          static_cast<std::uint32_t>(place_data.second.name.size()),
+                          static_cast<std::uint32_t>(place_data.second.place_type), 0});
+        text += place_data.second.name;
+    }
+    std::sort(places.begin(), places.end(), [](auto const& a, auto const& b){ return a.id < b.id; });
+
+    graph_file_header header = {};
+    std::memcpy(header.magic, GRAPH_FILE_MAGIC, sizeof(GRAPH_FILE_MAGIC));
+    header.version = GRAPH_FILE_VERSION;
+    header.crossroad_count = graph.size();
+    header.edge_count = graph.targets.size();
+    header.way_count = way_id_offsets.size() - 1;
+    header.place_count = places.size();
+    header.text_size = text.size();
+
+    std::string buffer(sizeof(header), '\0');
+    auto add_section = [&buffer](void const* data, std::size_t size){
+        buffer.resize((buffer.size() + 7) / 8 * 8, '\0');
+        std::uint64_t offset = buffer.size();
+        buffer.append(static_cast<char const*>(data), size);
+        return offset;
+    };
+    header.coords = add_section(graph.coords.data(), graph.coords.size() * sizeof(Coord));
+    header.offsets = add_section(graph.offsets.data(), graph.offsets.size() * sizeof(std::uint32_t));
+    header.targets = add_section(graph.targets.data(), graph.targets.size() * sizeof(std::uint32_t));
+    header.weights = add_section(graph.weights.data(), graph.weights.size() * sizeof(Distance));
+    header.edge_ways = add_section(edge_ways.data(), edge_ways.size() * sizeof(WayHandle));
+    header.coord_order = add_section(coord_order.data(), coord_order.size() * sizeof(std::uint32_t));
+    header.way_id_offsets = add_section(way_id_offsets.data(), way_id_offsets.size() * sizeof(std::uint32_t));
+    header.places = add_section(places.data(), places.size() * sizeof(mapped_graph::place_entry));
+    header.text = add_section(text.data(), text.size());
+    std::memcpy(&buffer[0], &header, sizeof(header));
+
+    std::ofstream output(filename, std::ios::binary);
+    output.write(buffer.data(), buffer.size());
+    return static_cast<bool>(output);
 }
 
-std::vector<std::tuple<Coord, WayID> > Datastructures::route_with_cycle(Coord fromxy)
+std::pair<Name, PlaceType> Datastructures::snapshot::get_place_name_type(PlaceID id) const
 {
-    // Replace this comment with your implementation
-    return {{NO_COORD, NO_WAY}};
+    place_record const* record = places_->find(id);
+    if (record == nullptr){
+        return {NO_NAME, PlaceType::NO_TYPE};
+    }
+    return {record->name, record->place_type};
 }
 
-std::vector<std::tuple<Coord, WayID, Distance> > Datastructures::route_shortest_distance(Coord fromxy, Coord toxy)
+Coord Datastructures::snapshot::get_place_coord(PlaceID id) const
 {
-    // Replace this comment with your implementation
-    return {{NO_COORD, NO_WAY, NO_DISTANCE}};
+    place_record const* record = places_->find(id);
+    if (record == nullptr){
+        return NO_COORD;
+    }
+    return record->coord;
 }
 
-Distance Datastructures::trim_ways()
+Name Datastructures::snapshot::get_area_name(AreaID id) const
 {
-    // Replace this comment with your implementation
-    return NO_DISTANCE;
+    area_record const* record = areas_->find(id);
+    if (record == nullptr){
+        return NO_NAME;
+    }
+    return record->name;
+}
+
+std::vector<Coord> Datastructures::snapshot::get_area_coords(AreaID id) const
+{
+    area_record const* record = areas_->find(id);
+    if (record == nullptr){
+        return {NO_COORD};
+    }
+    return record->coords;
+}
+
+std::vector<AreaID> Datastructures::snapshot::subarea_in_areas(AreaID id) const
+{
+    area_record const* record = areas_->find(id);
+    if (record == nullptr){
+        return {NO_AREA};
+    }
+
+    std::vector<AreaID> parent_areas;
+    for (AreaID parent = record->parent; parent != NO_AREA; parent = areas_->find(parent)->parent){
+        parent_areas.push_back(parent);
+    }
+    return parent_areas;
+}
+
+std::vector<Coord> Datastructures::snapshot::get_way_coords(WayID id) const
+{
+    auto it = way_handles_->find(id);
+    if (it == way_handles_->end()){
+        return {NO_COORD};
+    }
+    return graph_->ways[it->second]->coords;
+}
+
+std::vector<std::pair<WayID, Coord>> Datastructures::snapshot::ways_from(Coord xy) const
+{
+    return graph_ways_from(*graph_, xy);
+}
+
+std::vector<std::tuple<Coord, WayID, Distance>> Datastructures::snapshot::route_least_crossroads(Coord fromxy, Coord toxy) const
+{
+    search_lease lease(searches_);
+    return least_crossroads_route(*graph_, *lease, fromxy, toxy);
+}
+
+std::vector<std::tuple<Coord, WayID, Distance>> Datastructures::snapshot::route_shortest_distance(Coord fromxy, Coord toxy) const
+{
+    search_lease lease(searches_);
+    return shortest_distance_route(*graph_, *lease, fromxy, toxy);
+}
+
+std::unique_ptr<Datastructures::mapped_graph> Datastructures::mapped_graph::open(std::string const& filename)
+{
+    std::unique_ptr<mapped_graph> graph(new mapped_graph);
+
+#ifdef HAVE_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1){
+        return nullptr;
+    }
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0 or file_info.st_size <= 0){
+        ::close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED){
+        return nullptr;
+    }
+    graph->data_ = static_cast<char const*>(data);
+    graph->data_size_ = file_info.st_size;
+    graph->mapped_ = true;
+#else
+    std::ifstream input(filename, std::ios::binary);
+    if (!input){
+        return nullptr;
+    }
+    graph->buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    graph->data_ = graph->buffer_.data();
+    graph->data_size_ = graph->buffer_.size();
+#endif
+
+    graph_file_header header;
+    if (graph->data_size_ < sizeof(header)){
+        return nullptr;
+    }
+    std::memcpy(&header, graph->data_, sizeof(header));
+    if (std::memcmp(header.magic, GRAPH_FILE_MAGIC, sizeof(GRAPH_FILE_MAGIC)) != 0 or header.version != GRAPH_FILE_VERSION){
+        return nullptr;
+    }
+
+    // The sections have to follow each other as save_graph_file writes them, only padded to 8 bytes, and
+    // the last one has to end the file. A truncated file or a header whose counts do not match the
+    // sections is rejected here.
+    bool sections_ok = true;
+    std::uint64_t sections_end = sizeof(header);
+    auto section = [&](std::uint64_t offset, std::uint64_t count, std::size_t item_size){
+        if (offset % 8 != 0 or offset < sections_end or offset - sections_end >= 8 or offset > graph->data_size_
+                or count > (graph->data_size_ - offset) / item_size){
+            sections_ok = false;
+            return static_cast<void const*>(nullptr);
+        }
+        sections_end = offset + count * item_size;
+        return static_cast<void const*>(graph->data_ + offset);
+    };
+    graph->coords = static_cast<Coord const*>(section(header.coords, header.crossroad_count, sizeof(Coord)));
+    graph->offsets = static_cast<std::uint32_t const*>(section(header.offsets, header.crossroad_count + std::uint64_t(1), sizeof(std::uint32_t)));
+    graph->targets = static_cast<std::uint32_t const*>(section(header.targets, header.edge_count, sizeof(std::uint32_t)));
+    graph->weights = static_cast<Distance const*>(section(header.weights, header.edge_count, sizeof(Distance)));
+    graph->edge_ways = static_cast<WayHandle const*>(section(header.edge_ways, header.edge_count, sizeof(WayHandle)));
+    graph->coord_order_ = static_cast<std::uint32_t const*>(section(header.coord_order, header.crossroad_count, sizeof(std::uint32_t)));
+    graph->way_id_offsets_ = static_cast<std::uint32_t const*>(section(header.way_id_offsets, header.way_count + std::uint64_t(1), sizeof(std::uint32_t)));
+    graph->places_ = static_cast<place_entry const*>(section(header.places, header.place_count, sizeof(place_entry)));
+    graph->text_ = static_cast<char const*>(section(header.text, header.text_size, 1));
+    if (!sections_ok or sections_end != graph->data_size_){
+        return nullptr;
+    }
+
+    // Every index stored in the file is checked once, so that the searches can use them without bounds
+    // checks. Values that are only compared (coordinates, weights, place ids) are not checked.
+    if (graph->offsets[0] != 0 or graph->offsets[header.crossroad_count] != header.edge_count
+            or graph->way_id_offsets_[0] != 0 or graph->way_id_offsets_[header.way_count] > header.text_size){
+        return nullptr;
+    }
+    for (std::uint32_t i = 0; i < header.crossroad_count; i++){
+        if (graph->offsets[i] > graph->offsets[i+1] or graph->coord_order_[i] >= header.crossroad_count){
+            return nullptr;
+        }
+    }
+    for (std::uint32_t edge = 0; edge < header.edge_count; edge++){
+        if (graph->targets[edge] >= header.crossroad_count or graph->edge_ways[edge] >= header.way_count){
+            return nullptr;
+        }
+    }
+    for (std::uint32_t handle = 0; handle < header.way_count; handle++){
+        if (graph->way_id_offsets_[handle] > graph->way_id_offsets_[handle+1]){
+            return nullptr;
+        }
+    }
+    for (std::uint32_t i = 0; i < header.place_count; i++){
+        place_entry const& entry = graph->places_[i];
+        if (entry.name_offset > header.text_size or entry.name_length > header.text_size - entry.name_offset
+                or entry.type > static_cast<std::uint32_t>(PlaceType::NO_TYPE)){
+            return nullptr;
+        }
+    }
+
+    graph->crossroad_count_ = header.crossroad_count;
+    graph->place_count_ = header.place_count;
+    return graph;
+}
+
+Datastructures::mapped_graph::~mapped_graph()
+{
+#ifdef HAVE_MMAP
+    if (mapped_){
+        munmap(const_cast<char*>(data_), data_size_);
+    }
+#endif
+}
+
+std::uint32_t Datastructures::mapped_graph::find(Coord xy) const
+{
+    auto it = std::lower_bound(coord_order_, coord_order_ + crossroad_count_, xy,
+                               [this](std::uint32_t id, Coord value){ return coords[id] < value; });
+    if (it == coord_order_ + crossroad_count_ or coords[*it] != xy){
+        return NO_NODE;
+    }
+    return *it;
+}
+
+WayID Datastructures::mapped_graph::way_id(WayHandle handle) const
+{
+    return WayID(text_ + way_id_offsets_[handle], way_id_offsets_[handle+1] - way_id_offsets_[handle]);
+}
+
+Datastructures::mapped_graph::place_entry const* Datastructures::mapped_graph::find_place(PlaceID id) const
+{
+    auto it = std::lower_bound(places_, places_ + place_count_, id,
+                               [](place_entry const& entry, PlaceID value){ return entry.id < value; });
+    if (it == places_ + place_count_ or it->id != id){
+        return nullptr;
+    }
+    return it;
+}
+
+std::pair<Name, PlaceType> Datastructures::mapped_graph::get_place_name_type(PlaceID id) const
+{
+    place_entry const* entry = find_place(id);
+    if (entry == nullptr){
+        return {NO_NAME, PlaceType::NO_TYPE};
+    }
+    return {Name(text_ + entry->name_offset, entry->name_length), static_cast<PlaceType>(entry->type)};
+}
+
+Coord Datastructures::mapped_graph::get_place_coord(PlaceID id) const
+{
+    place_entry const* entry = find_place(id);
+    if (entry == nullptr){
+        return NO_COORD;
+    }
+    return entry->coord;
+}
+
+std::vector<std::pair<WayID, Coord>> Datastructures::mapped_graph::ways_from(Coord xy) const
+{
+    return graph_ways_from(*this, xy);
+}
+
+std::vector<std::tuple<Coord, WayID, Distance>> Datastructures::mapped_graph::route_least_crossroads(Coord fromxy, Coord toxy) const
+{
+    search_lease lease(searches_);
+    return least_crossroads_route(*this, *lease, fromxy, toxy);
+}
+
+std::vector<std::tuple<Coord, WayID, Distance>> Datastructures::mapped_graph::route_shortest_distance(Coord fromxy, Coord toxy) const
+{
+    search_lease lease(searches_);
+    return shortest_distance_route(*this, *lease, fromxy, toxy);
 }
@@ -4,12 +4,23 @@
 #define DATASTRUCTURES_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <tuple>
 #include <utility>
 #include <limits>
 #include <functional>
 #include <map>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <atomic>
 
 // Types for IDs
 using PlaceID = long long int;
@@ -49,11 +60,11 @@ struct CoordHash
 {
     std::size_t operator()(Coord xy) const
     {
-        auto hasher = std::hash<int>();
-        auto xhash = hasher(xy.x);
-        auto yhash = hasher(xy.y);
-        // Combine hash values (magic!)
-        return xhash ^ (yhash + 0x9e3779b9 + (xhash << 6) + (xhash >> 2));
+        // Both coordinates are packed into one 64-bit key and mixed with a multiplicative hash, so that
+        // nearby coordinates spread over all buckets instead of colliding in a few hash values
+        std::uint64_t key = (std::uint64_t(std::uint32_t(xy.x)) << 32) | std::uint32_t(xy.y);
+        key *= 0x9e3779b97f4a7c15ULL;
+        return key ^ (key >> 32);
     }
 };
 
@@ -79,6 +90,9 @@ Distance const NO_DISTANCE = NO_VALUE;
 
 // This is the class you are supposed to implement
 
+// Operations can be called from several threads at the same time. Queries (get_*, find_*, places_*,
+// area queries, ways_from and the route operations) share the data, operations that change places,
+// areas or ways run alone.
 class Datastructures
 {
 public:
@@ -113,30 +127,31 @@ public:
 
     // We recommend you implement the operations below only after implementing the ones above
 
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: inserting map items into another (empty) map
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: The name index is already sorted, so it is only walked through once
     std::vector<PlaceID> places_alphabetically();
 
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: Uses std::sort  where time complexity is O(nlog(n))
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: The coordinate index is already sorted, so it is only walked through once
     std::vector<PlaceID> places_coord_order();
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: Depends on the amount of keys (n) in map
+    // Estimate of performance: O(log(n) + k)
+    // Short rationale for estimate: multimap::equal_range finds the matching names in O(log(n)),
+    // k is the amount of places with the given name
     std::vector<PlaceID> find_places_name(Name const& name);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: Depends on the amount of keys (n) in map
+    // Estimate of performance: O(k)
+    // Short rationale for estimate: Places are kept in a bucket per type, so only the
+    // k places of the given type are copied
     std::vector<PlaceID> find_places_type(PlaceType type);
 
-    // Estimate of performance: Average for unordered_map O(1), worst case O(n)
-    // Short rationale for estimate: Elements are stored internally as Balanced Binary Search tree
-    // so above is the estimate of performance when using unordered_map::find
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: The old name index entry is erased through the stored iterator
+    // and the new one is inserted into the multimap in O(log(n))
     bool change_place_name(PlaceID id, Name const& newname);
 
-    // Estimate of performance: Average for unordered_map O(1), worst case O(n)
-    // Short rationale for estimate: Elements are stored internally as Balanced Binary Search tree
-    // so above is the estimate of performance when using unordered_map::find
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: The coordinate index entry is moved in the multimap in O(log(n))
     bool change_place_coord(PlaceID id, Coord newcoord);
 
     // We recommend you implement the operations below only after implementing the ones above
@@ -161,33 +176,34 @@ public:
 
     // Estimate of performance: Average for unordered_map O(1), worst case O(n)
     // Short rationale for estimate: Elements are stored internally as Balanced Binary Search tree
-    // so above is the estimate of performance when using unordered_map::find
+    // so above is the estimate of performance when using unordered_map::find.
+    // The area index is only marked invalid here.
     bool add_subarea_to_area(AreaID id, AreaID parentid);
 
-    // Estimate of performance: With the recursive function time complexity is O(n)
-    // Short rationale for estimate: Parentareas are checked recursively so performance depends on
-    // the amount of areas n
+    // Estimate of performance: O(d)
+    // Short rationale for estimate: Parent pointers are followed in a loop, d is the depth of the area
     std::vector<AreaID> subarea_in_areas(AreaID id);
 
-    //recursive helper function that subarea_in_areas() uses
-    void check_parentareas(AreaID id);
-
     // Non-compulsory operations
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(nlog(n) + V + E)
+    // Short rationale for estimate: Builds the area index, the ancestor table has log(n) levels
+    // for all n areas. The graph has one entry for each crossroad and connection. Publishing the
+    // snapshot copies the chunk pointers of the place and area tables, O(n/64), and the chunks of
+    // the ids changed since the previous snapshot. The whole table is laid out again in O(n) only
+    // after a clear, a load or when its size has doubled or halved.
     void creation_finished();
 
-    // Estimate of performance: With the recursive function time complexity is O(n)
-    // Short rationale for estimate: Subareas are checked recursively so performance depends on
-    // the amount of subareas n
+    // Estimate of performance: O(k), O(nlog(n)) if the area index has to be rebuilt
+    // Short rationale for estimate: Subareas of an area are one continuous slice of the pre-order
+    // layout, k is the amount of subareas
     std::vector<AreaID> all_subareas_in_area(AreaID id);
 
-    //helper function that all_subareas_in_areas() uses
-    void check_subareas(AreaID id);
-
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: Uses std::sort  where time complexity is O(nlog(n))
+    // Estimate of performance: Average O(1), worst case O(klog(k) + n)
+    // Short rationale for estimate: Grid cells around xy are visited ring by ring only until
+    // the three closest places are known, so on average only a few cells are checked. If the rings
+    // would visit more cells than there are non-empty cells (k), the non-empty cells are checked
+    // instead in order of distance, so sparse data does not make the search depend on the coordinates.
     std::vector<PlaceID> places_closest_to(Coord xy, PlaceType type);
 
     // Estimate of performance: Average for unordered_map O(1), worst case O(n)
@@ -195,8 +211,9 @@ public:
     // so above is the estimate of performance when using unordered_map
     bool remove_place(PlaceID id);
 
-    // Estimate of performance: O(nlog(n))
-    // Short rationale for estimate: Two operations (std::sort) where time complexity is O(nlog(n))
+    // Estimate of performance: O(log(d)), O(nlog(n)) if the area index has to be rebuilt
+    // Short rationale for estimate: Lowest common ancestor is found by binary lifting in the
+    // ancestor table, d is the depth of the deeper area
     AreaID common_area_of_subareas(AreaID id1, AreaID id2);
 
     // Phase 2 operations
@@ -209,8 +226,9 @@ public:
     // Short rationale for estimate: Because of for loop depends on the amount of coords (n)
     bool add_way(WayID id, std::vector<Coord> coords);
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: Because of for loop depends on the amount of keys (n) in map
+    // Estimate of performance: Average O(d), worst case O(n)
+    // Short rationale for estimate: The crossroad is found with unordered_map::find and its
+    // d connections are copied
     std::vector<std::pair<WayID, Coord>> ways_from(Coord xy);
 
     // Estimate of performance: Average for unordered_map O(1), worst case O(n)
@@ -225,32 +243,93 @@ public:
     // Estimate of performance: O(V+E) (DFS-algorithm)
     // Short rationale for estimate: V is the number of vertices and E is the number of edges in the graph.
     // Maximum loop amount for While-loop is O(V). Maximum loop amount for For-loop is O(E). So the time
-    // complexity for the whole algorithm is O(V+E).
+    // complexity for the whole algorithm is O(V+E). Only the crossroads the search reaches are reset,
+    // so a search that stops early does not pay for the whole graph.
     std::vector<std::tuple<Coord, WayID, Distance>> route_any(Coord fromxy, Coord toxy);
 
     // Non-compulsory operations
 
-    // Estimate of performance: O(n)
-    // Short rationale for estimate: Because of for loop depends on the amount of connections (n)
-    // crossroad has.
+    // Estimate of performance: Average O(d), worst case O(n)
+    // Short rationale for estimate: The connections (d) of both end crossroads are checked once
     bool remove_way(WayID id);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(V+E) (bidirectional BFS-algorithm)
+    // Short rationale for estimate: Both searches handle each crossroad and connection at most once,
+    // and only the crossroads they reach are reset. Always expanding the smaller frontier usually stops
+    // the searches long before the whole graph is explored.
     std::vector<std::tuple<Coord, WayID, Distance>> route_least_crossroads(Coord fromxy, Coord toxy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(V+E) (DFS-algorithm)
+    // Short rationale for estimate: Same as route_any. The DFS uses an explicit stack of crossroads
+    // and connection positions, so every connection is looked at most twice and no recursion is needed.
     std::vector<std::tuple<Coord, WayID>> route_with_cycle(Coord fromxy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O((V+E)log(V)) (A*-algorithm)
+    // Short rationale for estimate: Every reached crossroad is reset once and taken from the binary
+    // heap at most once, every connection pushes at most one heap entry. Heuristic is the straight line
+    // distance divided by sqrt(2), which never overestimates the truncated way lengths.
     std::vector<std::tuple<Coord, WayID, Distance>> route_shortest_distance(Coord fromxy, Coord toxy);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: O(Elog(E)) (Kruskal-algorithm)
+    // Short rationale for estimate: Ways are sorted by length, union-find with path compression and
+    // union by size is almost O(1) per way. Removed ways are erased in one pass over all containers.
+    // O(1) if no way has been added after the previous call, because the ways are already a forest.
     Distance trim_ways();
 
+    // Estimate of performance: O(q(V+E)log(V)/t)
+    // Short rationale for estimate: Every query q is one route_shortest_distance search. The queries are
+    // shared between t threads of a worker pool, each with its own search state, since the searches only read.
+    std::vector<std::vector<std::tuple<Coord, WayID, Distance>>> route_shortest_distance_batch(
+            std::vector<std::pair<Coord, Coord>> const& queries);
+
+    // Estimate of performance: O(q(V+E)/t)
+    // Short rationale for estimate: Same as route_shortest_distance_batch with route_least_crossroads searches.
+    std::vector<std::vector<std::tuple<Coord, WayID, Distance>>> route_least_crossroads_batch(
+            std::vector<std::pair<Coord, Coord>> const& queries);
+
+    // Bulk loading: between begin_bulk_load() and end_bulk_load() add_place and add_way only store the
+    // records (duplicate ids are still rejected). The secondary place indexes and the crossroads of the
+    // new ways are built in end_bulk_load(), so until then only place_count, all_places, all_areas,
+    // all_ways and the get_* queries see the new records. Operations that change existing places or
+    // ways build the pending indexes first.
+
+    // Estimate of performance: O(n)
+    // Short rationale for estimate: The containers are reserved for the expected amounts of records,
+    // which may be 0 when they are not known
+    void begin_bulk_load(std::size_t place_count = 0, std::size_t area_count = 0, std::size_t way_count = 0);
+
+    // Estimate of performance: O(klog(k) + k), k is the amount of records added during the session
+    // Short rationale for estimate: New places are sorted by name and by coordinate and appended to the
+    // indexes with end() hints, so the insertions are amortized O(1) when the indexes were empty. Each
+    // new way creates or finds its two crossroads with one lookup each.
+    void end_bulk_load();
+
+    // Read-only view of the data, see the class below
+    class snapshot;
+
+    // Estimate of performance: O(1)
+    // Short rationale for estimate: Only the pointer to the snapshot published last is copied
+    std::shared_ptr<snapshot const> published_snapshot();
+
+    // Estimate of performance: O(n + V + E)
+    // Short rationale for estimate: Every place, area, way coordinate and crossroad connection is
+    // written once into one buffer, which is then written to the file in one go
+    bool save_snapshot(std::string const& filename);
+
+    // Estimate of performance: O(nlog(n) + V + E)
+    // Short rationale for estimate: The file is read in one go and records are decoded without any text
+    // parsing. Places go to the ordered indexes in O(log(n)) each, crossroads are restored with their
+    // saved connections instead of being found again from the ways.
+    bool load_snapshot(std::string const& filename);
+
+    // Read-only graph file that is used in place through a memory mapping, see the class below
+    class mapped_graph;
+
+    // Estimate of performance: O(n log(n) + V log(V) + E)
+    // Short rationale for estimate: The graph arrays are written as they are, crossroads are sorted by
+    // coordinate and places by id so that the mapped file can be searched without building any index
+    bool save_graph_file(std::string const& filename);
+
 private:
     // Add stuff needed for your class implementation here
 
@@ -258,6 +337,9 @@ private:
         Name name;
         PlaceType place_type;
         Coord coord;
+        std::multimap<Name, PlaceID>::iterator name_it;
+        std::size_t type_index;
+        std::multimap<std::pair<long long int, int>, PlaceID>::iterator coord_it;
     };
 
     struct area{
@@ -266,36 +348,444 @@ private:
         std::vector<Coord> coords;
         std::vector<area*> subareas;
         area* parent_area;
+        std::size_t index;
     };
 
     std::unordered_map<PlaceID, place> places_;
+    // Name index that add_place, change_place_name and remove_place keep up to date
+    std::multimap<Name, PlaceID> places_by_name_;
+    // One bucket of place ids for every PlaceType (NO_TYPE included)
+    std::array<std::vector<PlaceID>, static_cast<std::size_t>(PlaceType::NO_TYPE)+1> places_by_type_;
+    // Coordinate index keyed on (squared distance from origin, y coord)
+    std::multimap<std::pair<long long int, int>, PlaceID> places_by_coord_;
+
+    // Uniform grid of places for places_closest_to. Cells are GRID_CELL_SIZE wide squares
+    // and only non-empty cells are stored. The bounds are the extreme cell coordinates of the
+    // non-empty cells, kept up to date with the amount of non-empty cells in every column and row.
+    static int const GRID_CELL_SIZE = 64;
+    struct place_grid{
+        std::unordered_map<std::uint64_t, std::vector<PlaceID>> cells;
+        std::map<int, std::size_t> column_cells;
+        std::map<int, std::size_t> row_cells;
+        int min_cx = 0;
+        int max_cx = -1;
+        int min_cy = 0;
+        int max_cy = -1;
+    };
+    // One grid for every PlaceType so that type filtered queries only look at matching places
+    std::array<place_grid, static_cast<std::size_t>(PlaceType::NO_TYPE)+1> grids_by_type_;
+
+    // Operations without locking, for the public operations and load_snapshot
+    bool insert_place(PlaceID id, Name const& name, PlaceType type, Coord xy);
+    void index_place(PlaceID id, place& place_data);
+    bool insert_area(AreaID id, Name const& name, std::vector<Coord> coords);
+    bool link_subarea(AreaID id, AreaID parentid);
+    void erase_places_areas();
+    void erase_ways();
+
+    //helper functions that keep grids_by_type_ up to date
+    void grid_insert(PlaceID id, PlaceType type, Coord xy);
+    void grid_erase(PlaceID id, PlaceType type, Coord xy);
+    static void update_grid_bounds(place_grid& grid);
+
     std::unordered_map<PlaceID, area> areas_;
-    std::vector<AreaID> parent_areas;
-    std::vector<AreaID> sub_areas;
+
+    // Area index built by build_area_index(). Areas get a dense index, area_ancestors_[k][i] is
+    // the 2^k:th ancestor of area i (roots are their own ancestors). area_preorder_ lists all
+    // area ids in pre-order, so the subtree of area i is area_subtree_size_[i] ids starting from
+    // area_preorder_pos_[i]. add_area and add_subarea_to_area invalidate the index and it is
+    // rebuilt when it is needed next time.
+    std::vector<area*> area_order_;
+    std::vector<std::size_t> area_depth_;
+    std::vector<std::vector<std::size_t>> area_ancestors_;
+    std::vector<AreaID> area_preorder_;
+    std::vector<std::size_t> area_preorder_pos_;
+    std::vector<std::size_t> area_subtree_size_;
+    std::atomic<bool> area_index_valid_{false};
+
+    void build_area_index();
+    // Builds the area index if it is invalid. Queries call this with the shared lock held.
+    void ensure_area_index();
 
     //datastructure for ways and crossroads
 
     // W=White, G=Gray, B=Black
     enum node {W, G, B};
 
-    struct way{
+    // A way never changes after it has been added, so its id, coordinates and length are kept in an
+    // immutable record. The id text is stored only in the record, way_handles_ refers to it.
+    struct way_record{
         WayID id = NO_WAY;
         std::vector<Coord> coords = {};
         Distance distance = NO_DISTANCE;
     };
 
+    struct way{
+        std::shared_ptr<way_record const> record = nullptr;
+        bool trimmed = false;
+    };
+
+    // Way handle: index of a way in ways_. Handles of removed ways are reused.
+    using WayHandle = std::uint32_t;
+
     struct Crossroad{
         Coord coords = NO_COORD;
-        std::vector<std::pair<Crossroad*, way*>> connections = {};
-        node colour = W;
-        Crossroad* last_crossroad = nullptr;
+        std::vector<std::pair<Crossroad*, WayHandle>> connections = {};
+        // Dense id of the crossroad in the graph snapshot, valid while graph_valid_ is true
+        std::uint32_t id = 0;
     };
 
 
-    std::unordered_map<WayID, way> ways_;
+    // Way ids are interned: way_handles_ is the only lookup by string, everything else uses
+    // handles. Its keys view the ids in the way records. Removed ways are left empty in ways_ and
+    // their handles are in free_way_handles_.
+    std::unordered_map<std::string_view, WayHandle> way_handles_;
+    std::vector<way> ways_;
+    std::vector<WayHandle> free_way_handles_;
     std::unordered_map<Coord, Crossroad, CoordHash> crossroads_;
+    // True when the ways are known to form a minimum spanning forest (set by trim_ways,
+    // cleared by add_way; removing ways keeps the ways a forest)
+    bool ways_trimmed_ = false;
+    // Total length of all ways
+    Distance ways_distance_ = 0;
+
+    // Connects a way to the crossroads at its ends, creating them if needed
+    void connect_way(WayHandle handle);
+
+    // Bulk load session state. Places and ways added during the session wait here until
+    // flush_bulk_load() puts them into the secondary indexes and crossroads_.
+    bool bulk_loading_ = false;
+    std::vector<std::pair<PlaceID, place*>> bulk_places_;
+    std::vector<WayHandle> bulk_ways_;
+    void flush_bulk_load();
+
+    // Compressed sparse row snapshot of crossroads_ that all route searches run on. Crossroad ids
+    // are 0..V-1 and the connections of crossroad u are the edges offsets[u]..offsets[u+1]-1.
+    // Every edge has a target crossroad, a length and the handle of its way. The crossroad ids are
+    // copied and the way records are shared by handle, so a graph never changes after it is built
+    // and published snapshots can keep using it.
+    // The graph is built by creation_finished() and rebuilt on demand after ways have changed.
+    static std::uint32_t const NO_NODE = std::numeric_limits<std::uint32_t>::max();
+    // The search engines are templates that work on any graph with these members, mapped_graph
+    // provides the same members on top of the file.
+    struct route_graph{
+        std::vector<Coord> coords;
+        std::vector<std::uint32_t> offsets = {0};
+        std::vector<std::uint32_t> targets;
+        std::vector<Distance> weights;
+        std::vector<WayHandle> edge_ways;
+        // Record of every way handle, nullptr for the handles of removed ways
+        std::vector<std::shared_ptr<way_record const>> ways;
+        std::unordered_map<Coord, std::uint32_t, CoordHash> ids;
+
+        std::size_t size() const { return coords.size(); }
+        std::uint32_t find(Coord xy) const
+        {
+            auto it = ids.find(xy);
+            return it == ids.end() ? NO_NODE : it->second;
+        }
+        WayID const& way_id(WayHandle handle) const { return ways[handle]->id; }
+    };
+    std::shared_ptr<route_graph const> graph_;
+    std::atomic<bool> graph_valid_{false};
+
+    void build_graph();
+    // Builds the graph if it is invalid. Queries call this with the shared lock held.
+    route_graph const& ensure_graph();
+
+    // Queries hold data_mutex_ shared and changes hold it exclusively. Queries that find the area
+    // index or the graph invalid build them under index_mutex_, so only one of them builds.
+    std::shared_mutex data_mutex_;
+    std::mutex index_mutex_;
+
+    // Search state of one crossroad, indexed by crossroad id. last_edge is the edge used to reach
+    // the crossroad, next and next_edge point towards the destination in route_least_crossroads.
+    struct search_node{
+        unsigned int epoch = 0;
+        node colour = W;
+        std::uint32_t last = NO_NODE;
+        std::uint32_t last_edge = NO_NODE;
+        Distance distance = NO_DISTANCE;
+        int hops = -1;
+        int back_hops = -1;
+        std::uint32_t next = NO_NODE;
+        std::uint32_t next_edge = NO_NODE;
+    };
 
+    // Everything one route search writes. Searches only read the graph, so searches with
+    // their own contexts can run at the same time. Buffers are kept to reuse their memory.
+    struct search_context{
+        std::vector<search_node> state;
+        // Every search gets a new epoch, so only the crossroads it touches are reset
+        unsigned int epoch = 0;
+        // Binary heap of (estimated total distance, distance so far, crossroad) for route_shortest_distance
+        std::vector<std::tuple<Distance, Distance, std::uint32_t>> heap;
+        // BFS frontiers of route_least_crossroads
+        std::vector<std::uint32_t> frontier;
+        std::vector<std::uint32_t> back_frontier;
+        std::vector<std::uint32_t> next_frontier;
+        // DFS stack of route_with_cycle: crossroad and the next edge to check
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> stack;
+        // DFS stack of route_any
+        std::vector<std::uint32_t> any_stack;
+    };
+
+    // Search contexts of finished route operations, reused by the next ones. Every route operation
+    // takes a context of its own, so concurrent queries do not share search state.
+    struct search_pool{
+        std::vector<std::unique_ptr<search_context>> contexts;
+        std::mutex mutex;
+
+        std::unique_ptr<search_context> acquire();
+        void release(std::unique_ptr<search_context> context);
+    };
+    search_pool searches_;
+
+    // Holds a pooled search context for the duration of one route operation
+    struct search_lease{
+        explicit search_lease(search_pool& pool) : pool(pool), context(pool.acquire()) {}
+        search_lease(search_lease const&) = delete;
+        search_lease& operator=(search_lease const&) = delete;
+        ~search_lease() { pool.release(std::move(context)); }
+        search_context& operator*() { return *context; }
+
+        search_pool& pool;
+        std::unique_ptr<search_context> context;
+    };
+
+    static void start_search(std::size_t crossroad_count, search_context& context);
+    static search_node& touch(search_context& context, std::uint32_t crossroad);
+
+    // Search engines behind the route operations
+    template <typename Graph>
+    static std::vector<std::tuple<Coord, WayID, Distance>> least_crossroads_route(
+            Graph const& graph, search_context& context, Coord fromxy, Coord toxy);
+    template <typename Graph>
+    static std::vector<std::tuple<Coord, WayID, Distance>> shortest_distance_route(
+            Graph const& graph, search_context& context, Coord fromxy, Coord toxy);
+    template <typename Graph>
+    static std::vector<std::pair<WayID, Coord>> graph_ways_from(Graph const& graph, Coord xy);
+
+    // Threads that run the batch route searches. The threads are started by the first batch and kept
+    // waiting for the next one until the pool is destroyed. One batch runs at a time and the calling
+    // thread works on it too. An exception thrown by the job on any thread is passed on to the caller
+    // once all threads have finished the batch.
+    class worker_pool{
+    public:
+        worker_pool() = default;
+        worker_pool(worker_pool const&) = delete;
+        worker_pool& operator=(worker_pool const&) = delete;
+        ~worker_pool();
+
+        // Calls job on every thread of the pool and on the calling thread, returns when all calls have returned
+        void run(std::function<void()> const& job);
+
+    private:
+        void work();
+        void run_job(std::function<void()> const& job);
+
+        std::vector<std::thread> threads_;
+        // Held for the whole batch, so that only one batch runs at a time
+        std::mutex run_mutex_;
+        std::mutex mutex_;
+        std::condition_variable start_;
+        std::condition_variable done_;
+        std::function<void()> const* job_ = nullptr;
+        // Incremented for every batch, threads wait until it changes
+        std::size_t batch_ = 0;
+        std::size_t running_ = 0;
+        bool stopping_ = false;
+        std::exception_ptr error_;
+    };
+    worker_pool batch_workers_;
+
+    // Runs one of the engines for every query in the worker pool, every thread with a search context of its own
+    using route_engine = std::vector<std::tuple<Coord, WayID, Distance>> (*)(route_graph const&, search_context&, Coord, Coord);
+    std::vector<std::vector<std::tuple<Coord, WayID, Distance>>> route_batch(
+            std::vector<std::pair<Coord, Coord>> const& queries, route_engine engine);
+
+    // Parts of a published snapshot. The place and area tables are split into chunks by id and
+    // every record is shared, so a new snapshot copies only the chunks that hold changed ids and
+    // shares the other chunks and all unchanged records with the previous one. The operations that
+    // change places and areas list the changed ids in changed_places_ and changed_areas_. Ways have
+    // changed when graph_ is not the graph of the previous snapshot. The ways themselves are the
+    // records of the graph, only the lookup by id is the snapshot's own.
+    struct place_record{
+        Name name;
+        PlaceType place_type;
+        Coord coord;
+    };
+    struct area_record{
+        Name name;
+        std::vector<Coord> coords;
+        AreaID parent = NO_AREA;
+    };
+    template <typename Key, typename Record>
+    struct chunked_table{
+        // Chunks are laid out for about this many records each
+        static std::size_t const CHUNK_SIZE = 64;
+        using chunk = std::unordered_map<Key, std::shared_ptr<Record const>>;
+        std::vector<std::shared_ptr<chunk const>> chunks;
+
+        std::size_t chunk_of(Key key) const { return std::hash<Key>{}(key) % chunks.size(); }
+        Record const* find(Key key) const
+        {
+            auto& records = *chunks[chunk_of(key)];
+            auto it = records.find(key);
+            return it == records.end() ? nullptr : it->second.get();
+        }
+    };
+    using place_table = chunked_table<PlaceID, place_record>;
+    using area_table = chunked_table<AreaID, area_record>;
+    using way_index = std::unordered_map<std::string_view, WayHandle>;
+
+    // Next version of a snapshot table: copies the chunks of the changed keys from previous and
+    // makes their records again from live, or lays out all of live when there is no usable previous
+    template <typename Key, typename Record, typename Live, typename MakeRecord>
+    static std::shared_ptr<chunked_table<Key, Record> const> next_table(
+            chunked_table<Key, Record> const* previous, std::vector<Key> const& changed, bool all_changed,
+            Live const& live, MakeRecord make_record);
+
+    std::shared_ptr<snapshot const> snapshot_;
+    // Ids changed since the last snapshot, or all of them when the flag is set
+    std::vector<PlaceID> changed_places_;
+    std::vector<AreaID> changed_areas_;
+    bool all_places_changed_ = true;
+    bool all_areas_changed_ = true;
+    void mark_place_changed(PlaceID id);
+    void mark_area_changed(AreaID id);
+
+    void publish_snapshot();
+
+
+};
+
+// Read-only view of the places, areas and ways published by Datastructures::creation_finished().
+// A snapshot never changes, so it is queried without locks and stays usable while the data
+// structures are changed or reloaded. The operations return what the Datastructures operations
+// of the same name returned when the snapshot was published.
+class Datastructures::snapshot
+{
+public:
+    // Estimate of performance: Average O(1), worst case O(n)
+    // Short rationale for estimate: unordered_map::find in one chunk of the place table
+    std::pair<Name, PlaceType> get_place_name_type(PlaceID id) const;
+
+    // Estimate of performance: Average O(1), worst case O(n)
+    // Short rationale for estimate: unordered_map::find in one chunk of the place table
+    Coord get_place_coord(PlaceID id) const;
+
+    // Estimate of performance: Average O(1), worst case O(n)
+    // Short rationale for estimate: unordered_map::find in one chunk of the area table
+    Name get_area_name(AreaID id) const;
+
+    // Estimate of performance: Average O(1), worst case O(n)
+    // Short rationale for estimate: unordered_map::find in one chunk of the area table
+    std::vector<Coord> get_area_coords(AreaID id) const;
+
+    // Estimate of performance: Average O(d), worst case O(dn)
+    // Short rationale for estimate: Parent ids are followed with one table lookup each, d is the depth of the area
+    std::vector<AreaID> subarea_in_areas(AreaID id) const;
+
+    // Estimate of performance: Average O(1), worst case O(n)
+    // Short rationale for estimate: unordered_map::find in the way index
+    std::vector<Coord> get_way_coords(WayID id) const;
+
+    // Estimate of performance: Average O(d), worst case O(n)
+    // Short rationale for estimate: The crossroad is found in the graph and its d edges are copied
+    std::vector<std::pair<WayID, Coord>> ways_from(Coord xy) const;
+
+    // Estimate of performance: O(V+E)
+    // Short rationale for estimate: Same search as Datastructures::route_least_crossroads
+    std::vector<std::tuple<Coord, WayID, Distance>> route_least_crossroads(Coord fromxy, Coord toxy) const;
+
+    // Estimate of performance: O((V+E)log(V))
+    // Short rationale for estimate: Same search as Datastructures::route_shortest_distance
+    std::vector<std::tuple<Coord, WayID, Distance>> route_shortest_distance(Coord fromxy, Coord toxy) const;
+
+private:
+    friend class Datastructures;
+    snapshot() = default;
+
+    std::shared_ptr<place_table const> places_;
+    std::shared_ptr<area_table const> areas_;
+    // Keys view the ids in the way records of graph_
+    std::shared_ptr<way_index const> way_handles_;
+    std::shared_ptr<route_graph const> graph_;
+    mutable search_pool searches_;
+};
 
+// Graph file written by Datastructures::save_graph_file(), used in place through a read-only memory
+// mapping. The file holds the CSR arrays, the coordinates, the way ids and the place table as flat
+// arrays that refer to each other by index and offset, so nothing has to be built when it is opened.
+// Processes that map the same file share one copy of it in the page cache. Opening checks the section
+// layout against the header and every stored index once, truncated or mismatched files are rejected.
+class Datastructures::mapped_graph
+{
+public:
+    // Estimate of performance: O(V+E+n)
+    // Short rationale for estimate: Every stored index is checked once against the header counts
+    // Returns nullptr if the file cannot be opened or is not a valid graph file
+    static std::unique_ptr<mapped_graph> open(std::string const& filename);
+    ~mapped_graph();
+    mapped_graph(mapped_graph const&) = delete;
+    mapped_graph& operator=(mapped_graph const&) = delete;
+
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: Binary search in the place table that is sorted by id
+    std::pair<Name, PlaceType> get_place_name_type(PlaceID id) const;
+
+    // Estimate of performance: O(log(n))
+    // Short rationale for estimate: Binary search in the place table that is sorted by id
+    Coord get_place_coord(PlaceID id) const;
+
+    // Estimate of performance: O(log(V) + d)
+    // Short rationale for estimate: The crossroad is found by binary search over the coordinate order,
+    // then its d edges are copied
+    std::vector<std::pair<WayID, Coord>> ways_from(Coord xy) const;
+
+    // Estimate of performance: O(V+E)
+    // Short rationale for estimate: Same search as Datastructures::route_least_crossroads
+    std::vector<std::tuple<Coord, WayID, Distance>> route_least_crossroads(Coord fromxy, Coord toxy) const;
+
+    // Estimate of performance: O((V+E)log(V))
+    // Short rationale for estimate: Same search as Datastructures::route_shortest_distance
+    std::vector<std::tuple<Coord, WayID, Distance>> route_shortest_distance(Coord fromxy, Coord toxy) const;
+
+private:
+    friend class Datastructures;
+    mapped_graph() = default;
+
+    // Graph members for the search engines, they point into the mapping
+    Coord const* coords = nullptr;
+    std::uint32_t const* offsets = nullptr;
+    std::uint32_t const* targets = nullptr;
+    Distance const* weights = nullptr;
+    WayHandle const* edge_ways = nullptr;
+
+    std::size_t size() const { return crossroad_count_; }
+    std::uint32_t find(Coord xy) const;
+    WayID way_id(WayHandle handle) const;
+
+    struct place_entry;
+    place_entry const* find_place(PlaceID id) const;
+
+    char const* data_ = nullptr;
+    std::size_t data_size_ = 0;
+    bool mapped_ = false;
+    // File contents when memory mapping is not available
+    std::vector<char> buffer_;
+
+    std::size_t crossroad_count_ = 0;
+    std::size_t place_count_ = 0;
+    // Crossroad ids in coordinate order
+    std::uint32_t const* coord_order_ = nullptr;
+    // Way id of handle h is text_[way_id_offsets_[h]..way_id_offsets_[h+1]-1]
+    std::uint32_t const* way_id_offsets_ = nullptr;
+    place_entry const* places_ = nullptr;
+    char const* text_ = nullptr;
+
+    mutable search_pool searches_;
 };
 
 #endif // DATASTRUCTURES_HH
@@ -38,6 +38,7 @@ using std::stringstream;
 
 #include <iomanip>
 using std::setw;
+using std::setprecision;
 
 #include <tuple>
 using std::tuple;
@@ -78,6 +79,9 @@ using std::vector;
 #include <set>
 using std::set;
 
+#include <unordered_map>
+using std::unordered_map;
+
 #include <array>
 using std::array;
 
@@ -96,9 +100,14 @@ using std::move;
 #include <utility>
 using std::pair;
 
+#include <optional>
+using std::optional;
+
 #include <cmath>
 using std::abs;
 
+#include <numeric>
+
 #include <cstdlib>
 using std::div;
 
@@ -111,6 +120,17 @@ using std::back_inserter;
 #include <cstddef>
 #include <cassert>
 
+#include <charconv>
+using std::from_chars;
+
+#include <cctype>
+
+#include <string_view>
+using std::string_view;
+
+#include <thread>
+#include <atomic>
+
 
 #include "mainprogram.hh"
 
@@ -132,13 +152,19 @@ MainProgram::CmdResult MainProgram::cmd_add_place(std::ostream& output, MatchIte
     assert( begin == end && "Impossible number of parameters!");
 
     PlaceID id = convert_string_to<PlaceID>(idstr);
+    Coord xy = {convert_string_to<int>(xstr), convert_string_to<int>(ystr)};
+
+    return add_place(output, id, name, typestr, xy);
+}
+
+MainProgram::CmdResult MainProgram::add_place(std::ostream& output, PlaceID id, Name const& name, string const& typestr, Coord xy)
+{
     PlaceType type = convert_string_to_placetype(typestr);
     if (type == PlaceType::NO_TYPE)
     {
         output << "Impossible place type: " << typestr << endl;
         return {ResultType::PLACEIDLIST, CmdResultPlaceIDs{NO_AREA, {NO_PLACE}}};
     }
-    Coord xy = {convert_string_to<int>(xstr), convert_string_to<int>(ystr)};
 
     bool success = ds_.add_place(id, name, type, xy);
     if (!success) { id = NO_PLACE; }
@@ -222,6 +248,11 @@ MainProgram::CmdResult MainProgram::cmd_add_area(std::ostream& output, MainProgr
         coords.push_back({convert_string_to<int>(coord[1]),convert_string_to<int>(coord[2])});
     }
 
+    return add_area(output, id, name, coords);
+}
+
+MainProgram::CmdResult MainProgram::add_area(std::ostream& output, AreaID id, Name const& name, vector<Coord> const& coords)
+{
     if (coords.size() < 3)
     {
         output << "An area must have at least 3 coords, only " << coords.size() << " coords given!" << endl;
@@ -403,6 +434,11 @@ MainProgram::CmdResult MainProgram::cmd_add_way(std::ostream& output, MainProgra
         coords.push_back({convert_string_to<int>(coord[1]),convert_string_to<int>(coord[2])});
     }
 
+    return add_way(output, id, coords);
+}
+
+MainProgram::CmdResult MainProgram::add_way(std::ostream& output, WayID const& id, vector<Coord> const& coords)
+{
     if (coords.size() < 2)
     {
         output << "A way must have at least 2 points, only " << coords.size() << " points given!" << endl;
@@ -817,6 +853,315 @@ MainProgram::CmdResult MainProgram::cmd_read(std::ostream& output, MatchIter beg
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (ds_.save_snapshot(filename))
+    {
+        output << "Snapshot saved to '" << filename << "'" << endl;
+    }
+    else
+    {
+        output << "Cannot save snapshot to '" << filename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (ds_.load_snapshot(filename))
+    {
+        output << "Snapshot loaded from '" << filename << "'" << endl;
+        view_dirty = true;
+    }
+    else
+    {
+        output << "Cannot load snapshot from '" << filename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_snapshot(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string holdstr = *begin++;
+    string releasestr = *begin++;
+    string placeidstr = *begin++;
+    string wayidstr = *begin++;
+    string fromxstr = *begin++;
+    string fromystr = *begin++;
+    string routefromxstr = *begin++;
+    string routefromystr = *begin++;
+    string routetoxstr = *begin++;
+    string routetoystr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (!holdstr.empty())
+    {
+        held_snapshot_ = ds_.published_snapshot();
+        output << "Holding the snapshot published by the last creation_finished" << endl;
+        return {};
+    }
+    if (!releasestr.empty())
+    {
+        held_snapshot_ = nullptr;
+        output << "Snapshot released" << endl;
+        return {};
+    }
+    if (!held_snapshot_)
+    {
+        output << "No snapshot held!" << endl;
+        return {};
+    }
+    auto& snapshot = *held_snapshot_;
+
+    if (!placeidstr.empty())
+    {
+        PlaceID placeid = convert_string_to<PlaceID>(placeidstr);
+        auto [name, type] = snapshot.get_place_name_type(placeid);
+        if (name == NO_NAME)
+        {
+            output << "Snapshot: No place ID " << placeid << "!" << endl;
+        }
+        else
+        {
+            output << "Snapshot: Place ID " << placeid << " has name '" << name << "', type '" << convert_placetype_to_string(type)
+                   << "' and pos=";
+            print_coord(snapshot.get_place_coord(placeid), output);
+        }
+        return {};
+    }
+
+    if (!wayidstr.empty())
+    {
+        auto coords = snapshot.get_way_coords(wayidstr);
+        output << "Snapshot: Way " << wayidstr << " has coords:" << endl;
+        std::for_each(coords.begin(), coords.end(), [&output,this](auto const& coord){ print_coord(coord,output); });
+        return {};
+    }
+
+    if (!fromxstr.empty())
+    {
+        Coord coord = {convert_string_to<int>(fromxstr),convert_string_to<int>(fromystr)};
+        auto ways = snapshot.ways_from(coord);
+        output << "Snapshot: Ways from ";
+        print_coord(coord, output, false);
+        output << ":" << endl;
+        if (ways.empty())
+        {
+            output << "No ways!" << endl;
+        }
+
+        sort(ways.begin(), ways.end());
+        vector<tuple<Coord, Coord, WayID, Distance>> result;
+        transform(ways.begin(), ways.end(), back_inserter(result),
+                  [coord](auto way)mutable{ return make_tuple(coord, way.second, way.first, NO_DISTANCE); });
+        return {ResultType::WAYS, CmdResultRoute{result}};
+    }
+
+    Coord fromxy = {convert_string_to<int>(routefromxstr),convert_string_to<int>(routefromystr)};
+    Coord toxy = {convert_string_to<int>(routetoxstr),convert_string_to<int>(routetoystr)};
+    output << "Snapshot: ";
+    print_route_batch(output, {{fromxy, toxy}}, {snapshot.route_shortest_distance(fromxy, toxy)});
+    return {};
+}
+
+void MainProgram::stage_data_file(StagedFile& file)
+{
+    ifstream input(file.filename, std::ios::binary);
+    if (!input)
+    {
+        file.error = "Cannot open file '" + file.filename + "'!";
+        return;
+    }
+    string text{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+    file.records.reserve(std::count(text.begin(), text.end(), '\n') + 1);
+
+    string_view rest = text;
+    unsigned int line_number = 0;
+    while (!rest.empty())
+    {
+        auto eol = rest.find('\n');
+        string_view line = rest.substr(0, eol);
+        rest = (eol == string_view::npos) ? string_view() : rest.substr(eol + 1);
+        ++line_number;
+
+        // Empty lines and comments are skipped
+        auto first = line.find_first_not_of(" \t\n\v\f\r");
+        if (first == string_view::npos || line[first] == '#') { continue; }
+
+        DataRecord record;
+        if (!parse_data_line(line, record))
+        {
+            file.error = "Line " + std::to_string(line_number) + " of '" + file.filename + "' is not a data command!";
+            return;
+        }
+        if (auto place = std::get_if<PlaceRecord>(&record))
+        {
+            try
+            {
+                convert_string_to_placetype(place->typestr);
+            }
+            catch (std::exception const&)
+            {
+                file.error = "Impossible place type on line " + std::to_string(line_number) + " of '" + file.filename + "'!";
+                return;
+            }
+        }
+        file.records.push_back(move(record));
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_read_data(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filesstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    vector<StagedFile> files;
+    for (auto start = filesstr.find('"'); start != string::npos; start = filesstr.find('"', start))
+    {
+        auto stop = filesstr.find('"', start + 1);
+        files.push_back({filesstr.substr(start + 1, stop - start - 1), {}, {}});
+        start = stop + 1;
+    }
+
+    // Files are parsed on worker threads that take the next file from a shared counter
+    std::size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    thread_count = std::min(thread_count, files.size());
+    std::atomic<std::size_t> next_file{0};
+    auto worker = [&files, &next_file](){
+        for (std::size_t i = next_file++; i < files.size(); i = next_file++)
+        {
+            stage_data_file(files[i]);
+        }
+    };
+    vector<std::thread> workers;
+    workers.reserve(thread_count - 1);
+    for (std::size_t i = 1; i < thread_count; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+
+    bool errors = false;
+    array<std::size_t, std::variant_size_v<DataRecord>> counts = {};
+    for (auto& file : files)
+    {
+        if (!file.error.empty())
+        {
+            output << file.error << endl;
+            errors = true;
+            continue;
+        }
+        output << "Read " << file.records.size() << " records from '" << file.filename << "'" << endl;
+        for (auto& record : file.records)
+        {
+            ++counts[record.index()];
+        }
+    }
+    if (errors)
+    {
+        output << "Nothing was added!" << endl;
+        return {};
+    }
+
+    // Records are committed kind by kind (places, areas, subareas, ways), each kind in file and line
+    // order, so that the result does not depend on the order the files were parsed in and subareas
+    // can refer to areas in any of the files
+    array<std::size_t, std::variant_size_v<DataRecord>> added = {};
+    ds_.begin_bulk_load(counts[0], counts[1], counts[3]);
+    for (std::size_t kind = 0; kind < counts.size(); ++kind)
+    {
+        for (auto& file : files)
+        {
+            for (auto& record : file.records)
+            {
+                if (record.index() != kind) { continue; }
+
+                bool ok = false;
+                if (auto place = std::get_if<PlaceRecord>(&record))
+                {
+                    ok = ds_.add_place(place->id, place->name, convert_string_to_placetype(place->typestr), place->xy);
+                }
+                else if (auto area = std::get_if<AreaRecord>(&record))
+                {
+                    ok = area->coords.size() >= 3 && ds_.add_area(area->id, area->name, move(area->coords));
+                }
+                else if (auto subarea = std::get_if<SubareaRecord>(&record))
+                {
+                    ok = ds_.add_subarea_to_area(subarea->id, subarea->parentid);
+                }
+                else if (auto way = std::get_if<WayRecord>(&record))
+                {
+                    ok = way->coords.size() >= 2 && ds_.add_way(way->id, move(way->coords));
+                }
+                if (ok) { ++added[kind]; }
+            }
+        }
+    }
+    ds_.end_bulk_load();
+    view_dirty = true;
+
+    output << "Added " << added[0] << " places, " << added[1] << " areas, " << added[2] << " subareas and " << added[3] << " ways" << endl;
+    std::size_t failed = (counts[0] + counts[1] + counts[2] + counts[3]) - (added[0] + added[1] + added[2] + added[3]);
+    if (failed > 0)
+    {
+        output << failed << " records could not be added!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_save_graph_file(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    if (ds_.save_graph_file(filename))
+    {
+        output << "Graph file saved to '" << filename << "'" << endl;
+    }
+    else
+    {
+        output << "Cannot save graph file to '" << filename << "'!" << endl;
+    }
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_graph_file_route(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    string filename = *begin++;
+    string fromxstr = *begin++;
+    string fromystr = *begin++;
+    string toxstr = *begin++;
+    string toystr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto graph = Datastructures::mapped_graph::open(filename);
+    if (!graph)
+    {
+        output << "Cannot open graph file '" << filename << "'!" << endl;
+        return {};
+    }
+
+    Coord fromxy = {convert_string_to<int>(fromxstr),convert_string_to<int>(fromystr)};
+    Coord toxy = {convert_string_to<int>(toxstr),convert_string_to<int>(toystr)};
+    output << "Graph file '" << filename << "': ";
+    print_route_batch(output, {{fromxy, toxy}}, {graph->route_shortest_distance(fromxy, toxy)});
+    return {};
+}
+
 
 MainProgram::CmdResult MainProgram::cmd_testread(std::ostream& output, MatchIter begin, MatchIter end)
 {
@@ -1149,6 +1494,30 @@ std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
     }
 }
 
+void MainProgram::print_route(CmdResultRoute const& route, std::ostream& output)
+{
+    if (!route.empty())
+    {
+        if (route.size() == 1 && get<0>(route.front()) == NO_COORD)
+        {
+            output << "Failed (NO_... returned)!!" << std::endl;
+        }
+        else
+        {
+            unsigned int num = 1;
+            for (auto& [coord, nextcoord, wayid, distance] : route)
+            {
+                output << num << ". ";
+                ++num;
+                print_coord(coord, output, false);
+                if (wayid != NO_WAY) { output << " way " << wayid; }
+                if (distance != NO_DISTANCE) { output << " distance " << distance; }
+                output << endl;
+            }
+        }
+    }
+}
+
 MainProgram::CmdResult MainProgram::cmd_find_places_name(std::ostream& output, MatchIter begin, MatchIter end)
 {
     string name = *begin++;
@@ -1367,6 +1736,60 @@ MainProgram::CmdResult MainProgram::cmd_route_least_crossroads(std::ostream& out
     return {ResultType::ROUTE, result};
 }
 
+vector<pair<Coord, Coord>> MainProgram::parse_coord_pairs(string const& coordsstr)
+{
+    vector<pair<Coord, Coord>> queries;
+    vector<Coord> coords;
+    smatch coord;
+    auto sbeg = coordsstr.cbegin();
+    auto send = coordsstr.cend();
+    for ( ; regex_search(sbeg, send, coord, coords_regex_); sbeg = coord.suffix().first)
+    {
+        coords.push_back({convert_string_to<int>(coord[1]),convert_string_to<int>(coord[2])});
+    }
+    for (std::size_t i = 0; i + 1 < coords.size(); i += 2)
+    {
+        queries.push_back({coords[i], coords[i+1]});
+    }
+    return queries;
+}
+
+void MainProgram::print_route_batch(std::ostream& output, vector<pair<Coord, Coord>> const& queries,
+                                    vector<vector<tuple<Coord, WayID, Distance>>> const& routes)
+{
+    for (std::size_t i = 0; i < routes.size(); ++i)
+    {
+        output << "Route " << i+1 << " from ";
+        print_coord(queries[i].first, output, false);
+        output << " to ";
+        print_coord(queries[i].second, output, false);
+        output << ":" << endl;
+
+        auto& steps = routes[i];
+        CmdResultRoute result;
+        if (steps.empty())
+        {
+            output << "No route found!" << endl;
+        }
+        else if (steps.front() == make_tuple(NO_COORD, NO_WAY, NO_DISTANCE))
+        {
+            output << "Starting or destination coord has no ways!" << endl;
+        }
+        else
+        {
+            auto [coord, wayid, dist] = steps.front();
+            for (auto iter = steps.begin()+1; iter != steps.end(); ++iter)
+            {
+                auto& [ncoord, nwayid, ndist] = *iter;
+                result.emplace_back(coord, ncoord, wayid, dist);
+                coord = ncoord; wayid = nwayid; dist = ndist;
+            }
+            result.emplace_back(coord, NO_COORD, NO_WAY, dist);
+        }
+        print_route(result, output);
+    }
+}
+
 void MainProgram::test_route_least_crossroads()
 {
     // Choose two random places
@@ -1530,12 +1953,27 @@ vector<MainProgram::CmdInfo> MainProgram::cmds_ =
     {"route_shortest_distance", "CoordFrom CoordTo", coordx+wsx+coordx, &MainProgram::cmd_route_shortest_distance, &MainProgram::test_route_shortest_distance },
     {"route_with_cycle", "Coordfrom", coordx, &MainProgram::cmd_route_with_cycle, &MainProgram::test_route_with_cycle },
     {"trim_ways", "", "", &MainProgram::cmd_trim_ways, &MainProgram::test_trim_ways },
+    {"route_shortest_distance_batch", "CoordFrom CoordTo [CoordFrom CoordTo...]", "("+optcoordx+wsx+optcoordx+"(?:"+wsx+optcoordx+wsx+optcoordx+")*)",
+     &MainProgram::RouteBatchCmd<&Datastructures::route_shortest_distance_batch>, &MainProgram::RouteBatchTestCmd<&Datastructures::route_shortest_distance_batch> },
+    {"route_least_crossroads_batch", "CoordFrom CoordTo [CoordFrom CoordTo...]", "("+optcoordx+wsx+optcoordx+"(?:"+wsx+optcoordx+wsx+optcoordx+")*)",
+     &MainProgram::RouteBatchCmd<&Datastructures::route_least_crossroads_batch>, &MainProgram::RouteBatchTestCmd<&Datastructures::route_least_crossroads_batch> },
     {"quit", "", "", nullptr, nullptr },
     {"help", "", "", &MainProgram::help_command, nullptr },
     {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
+    {"read_data", "\"filename\" [\"filename\"...]", "(\"[-a-zA-Z0-9 ./:_]+\"(?:"+wsx+"\"[-a-zA-Z0-9 ./:_]+\")*)", &MainProgram::cmd_read_data, nullptr },
     {"testread", "\"in-filename\" \"out-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+"\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_testread, nullptr },
-    {"perftest", "cmd1|all|compulsory[;cmd2...] timeout repeat_count n1[;n2...] (parts in [] are optional, alternatives separated by |)",
-     "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)", &MainProgram::cmd_perftest, nullptr },
+    {"save_snapshot", "\"filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_save_snapshot, nullptr },
+    {"load_snapshot", "\"filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_load_snapshot, nullptr },
+    {"save_graph_file", "\"filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_save_graph_file, nullptr },
+    {"graph_file_route", "\"filename\" CoordFrom CoordTo", "\"([-a-zA-Z0-9 ./:_]+)\""+wsx+coordx+wsx+coordx,
+     &MainProgram::cmd_graph_file_route, nullptr },
+    {"snapshot", "hold|release|place ID|way WayID|ways_from Coord|route CoordFrom CoordTo (alternatives separated by |)",
+     "(?:(hold)|(release)|place"+wsx+plcidx+"|way"+wsx+wayidx+"|ways_from"+wsx+coordx+"|route"+wsx+coordx+wsx+coordx+")",
+     &MainProgram::cmd_snapshot, nullptr },
+    {"perftest", "cmd1|all|compulsory[;cmd2...] timeout repeat_count n1[;n2...] [csv|json \"report-filename\"] [fit] (parts in [] are optional, alternatives separated by |)",
+     "([0-9a-zA-Z_]+(?:;[0-9a-zA-Z_]+)*)"+wsx+numx+wsx+numx+wsx+"([0-9]+(?:;[0-9]+)*)(?:"+wsx+"(csv|json)"+wsx+"\"([-a-zA-Z0-9 ./:_]+)\")?"
+     "(?:"+wsx+"(fit))?",
+     &MainProgram::cmd_perftest, nullptr },
     {"stopwatch", "on|off|next (alternatives separated by |)", "(?:(on)|(off)|(next))", &MainProgram::cmd_stopwatch, nullptr },
     {"random_seed", "new-random-seed-integer", numx, &MainProgram::cmd_randseed, nullptr },
     {"#", "comment text", ".*", &MainProgram::cmd_comment, nullptr },
@@ -1559,7 +1997,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
 #endif // _GLIBCXX_DEBUG
 
     vector<string> optional_cmds({"places_closest_to", "places_common_area", "route_least_crossroads", "route_with_cycle", "route_shortest_distance",
-                                  "add_walking_connections"});
+                                  "add_walking_connections", "route_shortest_distance_batch", "route_least_crossroads_batch"});
     vector<string> nondefault_cmds({"remove_place", "find_places", "way_coords"});
 
     string commandstr = *begin++;
@@ -1567,8 +2005,16 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     unsigned int repeat_count = convert_string_to<unsigned int>(*begin++);
 //    unsigned int friend_count = convert_string_to<unsigned int>(*begin++);
     string sizes = *begin++;
+    string report_format = *begin++;
+    string report_filename = *begin++;
+    string fitstr = *begin++;
     assert(begin == end && "Invalid number of parameters");
 
+    bool report = !report_format.empty();
+    bool fit = !fitstr.empty();
+    bool per_call = report || fit; // Time every test command call separately
+    vector<PerftestRound> rounds;
+
     vector<string> testcmds;
     bool additional_get_cmds = true;
     if (commandstr != "all" && commandstr != "compulsory")
@@ -1598,6 +2044,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
 
     // Initialize test functions
     vector<void(MainProgram::*)()> testfuncs;
+    vector<string> testnames;
     if (testcmds.empty())
     { // Add all commands
         for (auto& i : cmds_)
@@ -1609,6 +2056,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
                 {
                     output << i.cmd << " ";
                     testfuncs.push_back(i.testfunc);
+                    testnames.push_back(i.cmd);
                 }
             }
         }
@@ -1622,6 +2070,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
             {
                 output << i << " ";
                 testfuncs.push_back(pos->testfunc);
+                testnames.push_back(i);
             }
             else
             {
@@ -1638,8 +2087,17 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     }
 
 #ifdef USE_PERF_EVENT
+    {
+        Stopwatch probe(true);
+        if (!probe.counters_available())
+        {
+            output << "Hardware counters not available, only times are measured." << endl;
+        }
+    }
     output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "add (count)" << " , " << setw(12) << "cmds (sec)" << " , "
-           << setw(12) << "cmds (count)"  << " , " << setw(12) << "total (sec)" << " , " << setw(12) << "total (count)" << endl;
+           << setw(12) << "cmds (count)"  << " , " << setw(12) << "total (sec)" << " , " << setw(12) << "total (count)" << " , "
+           << setw(8) << "cmds IPC" << " , " << setw(12) << "cache-miss/op" << " , " << setw(12) << "branch-miss/op" << " , "
+           << setw(12) << "LLC-load/op" << endl;
 #else
     output << setw(7) << "N" << " , " << setw(12) << "add (sec)" << " , " << setw(12) << "cmds (sec)" << " , "
            << setw(12) << "total (sec)" << endl;
@@ -1718,12 +2176,21 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
         }
 
 #ifdef USE_PERF_EVENT
-        auto addcount = stopwatch.count();
+        auto addcounts = stopwatch.counts();
+        auto addcount = addcounts[Stopwatch::INSTRUCTIONS];
+        // "-" instead of a count that could not be measured
+        auto countstr = [&stopwatch](Stopwatch::Counter counter, double value)
+        {
+            if (!stopwatch.counter_available(counter)) { return string("-"); }
+            ostringstream str;
+            str << value;
+            return str.str();
+        };
 #endif
         auto addsec = stopwatch.elapsed();
 
 #ifdef USE_PERF_EVENT
-        output << setw(12) << addsec << " , " << setw(12) << addcount << " , " << flush;
+        output << setw(12) << addsec << " , " << setw(12) << countstr(Stopwatch::INSTRUCTIONS, addcount) << " , " << flush;
 #else
         output << setw(12) << addsec << " , " << flush;
 #endif
@@ -1735,13 +2202,48 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
             break;
         }
 
+        PerftestRound round;
+        Stopwatch callwatch(report); // Per call counters are only written to the report
+        if (per_call)
+        {
+            round.n = n;
+            for (auto& name : testnames)
+            {
+                round.cmds.push_back({name, {}, 0});
+            }
+        }
+
         stopwatch.start();
         ds_.creation_finished();
         for (unsigned int repeat = 0; repeat < repeat_count; ++repeat)
         {
             auto cmdpos = random(testfuncs.begin(), testfuncs.end());
 
-            (this->**cmdpos)();
+            if (per_call)
+            {
+                auto& cmdstats = round.cmds[cmdpos - testfuncs.begin()];
+                callwatch.reset();
+                callwatch.start();
+                (this->**cmdpos)();
+                callwatch.stop();
+                cmdstats.latencies.push_back(callwatch.elapsed());
+#ifdef USE_PERF_EVENT
+                auto counts = callwatch.counts();
+                auto accumulate_counter = [&callwatch, &counts](long long& total, Stopwatch::Counter counter)
+                {
+                    total = callwatch.counter_available(counter) ? total + counts[counter] : -1;
+                };
+                accumulate_counter(cmdstats.cycles, Stopwatch::CYCLES);
+                accumulate_counter(cmdstats.instructions, Stopwatch::INSTRUCTIONS);
+                accumulate_counter(cmdstats.cache_misses, Stopwatch::CACHE_MISSES);
+                accumulate_counter(cmdstats.branch_misses, Stopwatch::BRANCH_MISSES);
+                accumulate_counter(cmdstats.llc_loads, Stopwatch::LLC_LOADS);
+#endif
+            }
+            else
+            {
+                (this->**cmdpos)();
+            }
             if (additional_get_cmds)
             {
                 if (random_places_added_ > 0) // Don't do anything if there's no places
@@ -1779,12 +2281,32 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
         if (stop) { break; }
 
 #ifdef USE_PERF_EVENT
-        auto totalcount = stopwatch.count();
+        auto totalcounts = stopwatch.counts();
+        auto totalcount = totalcounts[Stopwatch::INSTRUCTIONS];
+        auto cmdscount = [&totalcounts, &addcounts](Stopwatch::Counter counter)
+        {
+            return static_cast<double>(totalcounts[counter] - addcounts[counter]);
+        };
 #endif
         auto totalsec = stopwatch.elapsed();
 
+        if (per_call)
+        {
+            round.addsec = addsec;
+            round.cmdssec = totalsec-addsec;
+            rounds.push_back(move(round));
+        }
+
 #ifdef USE_PERF_EVENT
-        output << setw(12) << totalsec-addsec << " , " << setw(12) << totalcount-addcount << " , " << setw(12) << totalsec << " , " << setw(12) << totalcount;
+        output << setw(12) << totalsec-addsec << " , " << setw(12) << countstr(Stopwatch::INSTRUCTIONS, totalcount-addcount) << " , "
+               << setw(12) << totalsec << " , " << setw(12) << countstr(Stopwatch::INSTRUCTIONS, totalcount) << " , ";
+        // Instructions per cycle and misses/loads per executed command of the cmds phase
+        auto cmdscycles = cmdscount(Stopwatch::CYCLES);
+        output << setw(8) << (stopwatch.counter_available(Stopwatch::CYCLES) && cmdscycles > 0
+                              ? countstr(Stopwatch::INSTRUCTIONS, cmdscount(Stopwatch::INSTRUCTIONS) / cmdscycles) : string("-")) << " , "
+               << setw(12) << countstr(Stopwatch::CACHE_MISSES, cmdscount(Stopwatch::CACHE_MISSES) / repeat_count) << " , "
+               << setw(12) << countstr(Stopwatch::BRANCH_MISSES, cmdscount(Stopwatch::BRANCH_MISSES) / repeat_count) << " , "
+               << setw(12) << countstr(Stopwatch::LLC_LOADS, cmdscount(Stopwatch::LLC_LOADS) / repeat_count);
 #else
         output << setw(12) << totalsec-addsec << " , " << setw(12) << totalsec;
 #endif
@@ -1805,6 +2327,22 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     ds_.clear_ways();
     init_primes();
 
+    if (report)
+    {
+        if (write_perftest_report(report_format, report_filename, rounds))
+        {
+            output << "Perftest report written to '" << report_filename << "'" << endl;
+        }
+        else
+        {
+            output << "Cannot write perftest report to '" << report_filename << "'!" << endl;
+        }
+    }
+    if (fit)
+    {
+        print_complexity_fit(output, rounds);
+    }
+
 #ifdef _GLIBCXX_DEBUG
     output << "WARNING: Debug STL enabled, performance will be worse than expected (maybe also asymptotically)!" << endl;
 #endif // _GLIBCXX_DEBUG
@@ -1812,10 +2350,469 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     return {};
 }
 
-MainProgram::CmdResult MainProgram::cmd_comment(std::ostream& /*output*/, MatchIter /*begin*/, MatchIter /*end*/)
-{
-    return {};
-}
+// Expected complexity of the perftest commands in terms of N, from the estimates in datastructures.hh.
+// Operations that use the area index or the route graph include rebuilding it, because the random
+// commands in the mix invalidate them.
+unordered_map<string, MainProgram::Complexity> const MainProgram::expected_complexity_ =
+{
+    {"random_add", Complexity::LOGN},
+    {"place_name_type", Complexity::CONSTANT},
+    {"place_coord", Complexity::CONSTANT},
+    {"area_name", Complexity::CONSTANT},
+    {"places_alphabetically", Complexity::LINEAR},
+    {"places_coord_order", Complexity::LINEAR},
+    {"places_closest_to", Complexity::CONSTANT},
+    {"common_area_of_subareas", Complexity::NLOGN},
+    {"find_places_name", Complexity::LOGN},
+    {"find_places_type", Complexity::LINEAR},
+    {"change_place_name", Complexity::LOGN},
+    {"change_place_coord", Complexity::LOGN},
+    {"remove_place", Complexity::CONSTANT},
+    {"subarea_in_areas", Complexity::LOGN},
+    {"all_subareas_in_area", Complexity::NLOGN},
+    {"random_ways", Complexity::CONSTANT},
+    {"ways_from", Complexity::CONSTANT},
+    {"way_coords", Complexity::CONSTANT},
+    {"remove_way", Complexity::CONSTANT},
+    {"route_any", Complexity::LINEAR},
+    {"route_least_crossroads", Complexity::LINEAR},
+    {"route_with_cycle", Complexity::LINEAR},
+    {"route_shortest_distance", Complexity::NLOGN},
+    {"route_shortest_distance_batch", Complexity::NLOGN},
+    {"route_least_crossroads_batch", Complexity::LINEAR},
+    {"trim_ways", Complexity::NLOGN},
+};
+
+string const complexity_names[] = {"O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)"};
+
+double MainProgram::complexity_value(Complexity complexity, double n)
+{
+    switch (complexity)
+    {
+        case Complexity::CONSTANT: return 1.0;
+        case Complexity::LOGN: return std::log2(n);
+        case Complexity::LINEAR: return n;
+        case Complexity::NLOGN: return n * std::log2(n);
+        default: return n * n;
+    }
+}
+
+// Exponent k of the power law t = c*n^k that fits the (n, t) pairs best, i.e. the least squares
+// slope of ln(t) against ln(n)
+double growth_exponent(vector<pair<double, double>> const& times)
+{
+    double xsum = 0;
+    double ysum = 0;
+    for (auto& [n, t] : times)
+    {
+        xsum += std::log(n);
+        ysum += std::log(t);
+    }
+    double xmean = xsum / times.size();
+    double ymean = ysum / times.size();
+
+    double xysum = 0;
+    double x2sum = 0;
+    for (auto& [n, t] : times)
+    {
+        xysum += (std::log(n) - xmean) * (std::log(t) - ymean);
+        x2sum += (std::log(n) - xmean) * (std::log(n) - xmean);
+    }
+    return (x2sum > 0) ? xysum / x2sum : 0;
+}
+
+MainProgram::ComplexityFit MainProgram::fit_complexity(vector<pair<double, double>> const& times)
+{
+    // Every model t = c*f(n) is fitted by least squares in log space, ln(t) = ln(c) + ln(f(n)), so that
+    // all sizes weigh the same even though the times differ by orders of magnitude. The error of a
+    // model is the standard deviation of ln(t/f(n)), which is 0 for a perfect fit.
+    ComplexityFit result;
+    for (std::size_t model = 0; model < result.errors.size(); ++model)
+    {
+        double sum = 0;
+        double sum2 = 0;
+        for (auto& [n, t] : times)
+        {
+            double residual = std::log(t / complexity_value(static_cast<Complexity>(model), n));
+            sum += residual;
+            sum2 += residual * residual;
+        }
+        double mean = sum / times.size();
+        result.errors[model] = std::sqrt(std::max(0.0, sum2 / times.size() - mean * mean));
+    }
+
+    auto order = result.errors;
+    sort(order.begin(), order.end());
+    result.best = static_cast<Complexity>(std::min_element(result.errors.begin(), result.errors.end()) - result.errors.begin());
+    // Confidence tells how much better the best model fits than the runner-up, 1 is a perfect fit
+    result.confidence = (order[1] > 0) ? 1 - order[0] / order[1] : 1;
+    result.exponent = growth_exponent(times);
+    return result;
+}
+
+void MainProgram::print_complexity_fit(std::ostream& output, vector<PerftestRound> const& rounds)
+{
+    if (rounds.empty()) { return; }
+
+    output << endl << "Complexity fit of the median time per call:" << endl;
+    output << setw(24) << "command" << " , " << setw(10) << "best fit" << " , " << setw(10) << "confidence" << " , "
+           << setw(10) << "n^k, k" << " , " << setw(10) << "expected" << endl;
+
+    unsigned int worse_count = 0;
+    for (std::size_t i = 0; i < rounds.front().cmds.size(); ++i)
+    {
+        string const& cmd = rounds.front().cmds[i].cmd;
+        vector<pair<double, double>> times;
+        for (auto& round : rounds)
+        {
+            // The median is not thrown off by occasional rehashing or index rebuilds
+            vector<double> latencies = round.cmds[i].latencies;
+            if (round.n <= 1 || latencies.empty()) { continue; }
+            auto middle = latencies.begin() + latencies.size() / 2;
+            std::nth_element(latencies.begin(), middle, latencies.end());
+            if (*middle > 0)
+            {
+                times.push_back({static_cast<double>(round.n), *middle});
+            }
+        }
+
+        output << setw(24) << cmd << " , ";
+        if (times.size() < 3)
+        {
+            output << "too few sizes measured" << endl;
+            continue;
+        }
+
+        auto fitted = fit_complexity(times);
+        auto expected = expected_complexity_.find(cmd);
+        output << setw(10) << complexity_names[static_cast<std::size_t>(fitted.best)] << " , " << setw(10) << setprecision(2)
+               << fitted.confidence << " , " << setw(10) << fitted.exponent << setprecision(6) << " , "
+               << setw(10) << (expected != expected_complexity_.end() ? complexity_names[static_cast<std::size_t>(expected->second)] : "-");
+
+        // Cache effects and timer noise easily move the best fit of fast operations one class up, so
+        // a worse class is only reported when the times also grow at least n^0.75 faster than the
+        // expected class does over the same sizes
+        if (expected != expected_complexity_.end() && fitted.best > expected->second)
+        {
+            vector<pair<double, double>> expected_times;
+            for (auto& [n, t] : times)
+            {
+                expected_times.push_back({n, complexity_value(expected->second, n)});
+            }
+            if (fitted.exponent - growth_exponent(expected_times) >= 0.75)
+            {
+                output << " , WORSE THAN EXPECTED";
+                ++worse_count;
+            }
+        }
+        output << endl;
+    }
+
+    if (worse_count > 0)
+    {
+        output << worse_count << " operation(s) worse than expected!" << endl;
+        complexity_regression_ = true;
+    }
+    else
+    {
+        output << "All operations within expected complexity." << endl;
+    }
+}
+
+#ifdef USE_PERF_EVENT
+vector<pair<string, optional<double>>> MainProgram::perftest_counter_values(PerftestCmdStats const& cmdstats)
+{
+    auto ops = static_cast<double>(cmdstats.latencies.size());
+    auto value = [](long long count, double divisor) -> optional<double>
+    {
+        if (count < 0 || divisor <= 0) { return {}; }
+        return count / divisor;
+    };
+    return {{"instructions", value(cmdstats.instructions, 1)},
+            {"cycles", value(cmdstats.cycles, 1)},
+            {"ipc", value(cmdstats.instructions, cmdstats.cycles)},
+            {"cache_misses_per_op", value(cmdstats.cache_misses, ops)},
+            {"branch_misses_per_op", value(cmdstats.branch_misses, ops)},
+            {"llc_loads_per_op", value(cmdstats.llc_loads, ops)}};
+}
+#endif
+
+bool MainProgram::write_perftest_report(string const& format, string const& filename, vector<PerftestRound> const& rounds)
+{
+    std::ofstream report(filename);
+    report << setprecision(9);
+
+    bool json = (format == "json");
+    if (json)
+    {
+        report << "[" << endl;
+    }
+    else
+    {
+        report << "n,command,count,mean_sec,p50_sec,p99_sec,max_sec";
+#ifdef USE_PERF_EVENT
+        report << ",instructions,cycles,ipc,cache_misses_per_op,branch_misses_per_op,llc_loads_per_op";
+#endif
+        report << endl;
+    }
+
+    for (auto roundpos = rounds.begin(); roundpos != rounds.end(); ++roundpos)
+    {
+        auto& round = *roundpos;
+        if (json)
+        {
+            report << "  {\"n\": " << round.n << ", \"add_sec\": " << round.addsec << ", \"cmds_sec\": " << round.cmdssec
+                   << ", \"total_sec\": " << round.addsec + round.cmdssec << ", \"commands\": [" << endl;
+        }
+
+        bool first = true;
+        for (auto& cmdstats : round.cmds)
+        {
+            if (cmdstats.latencies.empty()) { continue; }
+
+            // Nearest-rank percentiles of the sorted latencies
+            vector<double> latencies = cmdstats.latencies;
+            sort(latencies.begin(), latencies.end());
+            auto percentile = [&latencies](unsigned int p){ return latencies[(latencies.size() * p + 99) / 100 - 1]; };
+            double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+
+            if (json)
+            {
+                report << (first ? "" : ",\n") << "    {\"command\": \"" << cmdstats.cmd << "\", \"count\": " << latencies.size()
+                       << ", \"mean_sec\": " << mean << ", \"p50_sec\": " << percentile(50) << ", \"p99_sec\": " << percentile(99)
+                       << ", \"max_sec\": " << latencies.back();
+#ifdef USE_PERF_EVENT
+                auto counters = perftest_counter_values(cmdstats);
+                for (auto& counter : counters)
+                {
+                    report << ", \"" << counter.first << "\": ";
+                    if (counter.second) { report << *counter.second; } else { report << "null"; }
+                }
+#endif
+                report << "}";
+            }
+            else
+            {
+                report << round.n << "," << cmdstats.cmd << "," << latencies.size() << "," << mean << "," << percentile(50) << ","
+                       << percentile(99) << "," << latencies.back();
+#ifdef USE_PERF_EVENT
+                auto counters = perftest_counter_values(cmdstats);
+                for (auto& counter : counters)
+                {
+                    report << ",";
+                    if (counter.second) { report << *counter.second; }
+                }
+#endif
+                report << endl;
+            }
+            first = false;
+        }
+
+        if (json)
+        {
+            report << (first ? "" : "\n") << "  ]}" << (next(roundpos) != rounds.end() ? "," : "") << endl;
+        }
+    }
+
+    if (json)
+    {
+        report << "]" << endl;
+    }
+
+    return static_cast<bool>(report);
+}
+
+MainProgram::CmdResult MainProgram::cmd_comment(std::ostream& /*output*/, MatchIter /*begin*/, MatchIter /*end*/)
+{
+    return {};
+}
+
+// Scanner for the fixed formats of the bulk data commands, accepts the same characters as the regexs above
+class LineScanner
+{
+public:
+    explicit LineScanner(string_view line) : pos_(line.data()), end_(line.data() + line.size()) {}
+
+    bool at_end() const { return pos_ == end_; }
+
+    // Returns true if at least one whitespace character was skipped
+    bool skip_space()
+    {
+        auto start = pos_;
+        while (pos_ != end_ && std::isspace(static_cast<unsigned char>(*pos_))) { ++pos_; }
+        return pos_ != start;
+    }
+
+    bool literal(char c)
+    {
+        if (pos_ == end_ || *pos_ != c) { return false; }
+        ++pos_;
+        return true;
+    }
+
+    // Reads a run of at least one character accepted by allowed
+    template <typename Pred>
+    bool token(string_view& value, Pred allowed)
+    {
+        auto start = pos_;
+        while (pos_ != end_ && allowed(*pos_)) { ++pos_; }
+        value = string_view(start, pos_ - start);
+        return pos_ != start;
+    }
+
+    // Reads an unsigned decimal number, fails on overflow
+    template <typename Int>
+    bool number(Int& value)
+    {
+        if (pos_ == end_ || !std::isdigit(static_cast<unsigned char>(*pos_))) { return false; }
+        auto [ptr, ec] = from_chars(pos_, end_, value);
+        if (ec != std::errc()) { return false; }
+        pos_ = ptr;
+        return true;
+    }
+
+    // Reads (x,y) with optional whitespace inside the parentheses
+    bool coord(Coord& xy)
+    {
+        if (!literal('(')) { return false; }
+        skip_space();
+        if (!number(xy.x)) { return false; }
+        skip_space();
+        if (!literal(',')) { return false; }
+        skip_space();
+        if (!number(xy.y)) { return false; }
+        skip_space();
+        return literal(')');
+    }
+
+    // Reads a whitespace separated list of one or more coordinates up to the end of the line
+    bool coord_list(vector<Coord>& coords)
+    {
+        while (skip_space())
+        {
+            if (at_end()) { break; }
+            Coord xy;
+            if (!coord(xy)) { return false; }
+            coords.push_back(xy);
+        }
+        return at_end() && !coords.empty();
+    }
+
+private:
+    char const* pos_;
+    char const* end_;
+};
+
+bool is_alnum_char(char c) { return std::isalnum(static_cast<unsigned char>(c)); }
+bool is_name_char(char c) { return is_alnum_char(c) || c == ' ' || c == '-'; }
+
+bool MainProgram::parse_data_line(string_view line, DataRecord& record)
+{
+    LineScanner scanner(line);
+    scanner.skip_space();
+    string_view cmd;
+    if (!scanner.token(cmd, [](char c){ return is_alnum_char(c) || c == '_'; }) || !scanner.skip_space())
+    {
+        return false;
+    }
+
+    if (cmd == "add_place")
+    {
+        PlaceID id;
+        string_view name;
+        string_view typestr;
+        Coord xy;
+        if (!scanner.number(id) || !scanner.skip_space() ||
+            !scanner.literal('\'') || !scanner.token(name, is_name_char) || !scanner.literal('\'') || !scanner.skip_space() ||
+            !scanner.token(typestr, is_alnum_char) || !scanner.skip_space() || !scanner.coord(xy))
+        {
+            return false;
+        }
+        scanner.skip_space();
+        if (!scanner.at_end()) { return false; }
+        record = PlaceRecord{id, Name(name), string(typestr), xy};
+    }
+    else if (cmd == "add_area")
+    {
+        AreaID id;
+        string_view name;
+        vector<Coord> coords;
+        if (!scanner.number(id) || !scanner.skip_space() ||
+            !scanner.literal('\'') || !scanner.token(name, is_name_char) || !scanner.literal('\'') || !scanner.coord_list(coords))
+        {
+            return false;
+        }
+        record = AreaRecord{id, Name(name), move(coords)};
+    }
+    else if (cmd == "add_subarea_to_area")
+    {
+        AreaID id;
+        AreaID parentid;
+        if (!scanner.number(id) || !scanner.skip_space() || !scanner.number(parentid))
+        {
+            return false;
+        }
+        scanner.skip_space();
+        if (!scanner.at_end()) { return false; }
+        record = SubareaRecord{id, parentid};
+    }
+    else if (cmd == "add_way")
+    {
+        string_view id;
+        vector<Coord> coords;
+        if (!scanner.token(id, is_alnum_char) || !scanner.coord_list(coords))
+        {
+            return false;
+        }
+        record = WayRecord{WayID(id), move(coords)};
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool MainProgram::fast_parse_line(string const& inputline, string& cmd, ParsedCmd& command)
+{
+    DataRecord record;
+    if (!parse_data_line(inputline, record))
+    {
+        return false;
+    }
+
+    if (auto place = std::get_if<PlaceRecord>(&record))
+    {
+        cmd = "add_place";
+        command = [this, place = move(*place)](std::ostream& out){ return add_place(out, place.id, place.name, place.typestr, place.xy); };
+    }
+    else if (auto area = std::get_if<AreaRecord>(&record))
+    {
+        cmd = "add_area";
+        command = [this, area = move(*area)](std::ostream& out){ return add_area(out, area.id, area.name, area.coords); };
+    }
+    else if (auto way = std::get_if<WayRecord>(&record))
+    {
+        cmd = "add_way";
+        command = [this, way = move(*way)](std::ostream& out){ return add_way(out, way.id, way.coords); };
+    }
+    else
+    {
+        return false; // add_subarea_to_area goes through the regex path, it is rare in data files
+    }
+
+    return true;
+}
+
+void MainProgram::end_bulk_load()
+{
+    if (bulk_loading_)
+    {
+        ds_.end_bulk_load();
+        bulk_loading_ = false;
+    }
+}
 
 bool MainProgram::command_parse_line(string inputline, ostream& output)
 {
@@ -1824,197 +2821,214 @@ bool MainProgram::command_parse_line(string inputline, ostream& output)
 
     if (inputline.empty()) { return true; }
 
-    smatch match;
-    bool matched = regex_match(inputline, match, cmds_regex_);
-    if (matched)
+    string cmd;
+    ParsedCmd command;
+    string params;
+    smatch match2;
+    if (fast_parse_line(inputline, cmd, command))
     {
+        if (!bulk_loading_)
+        {
+            ds_.begin_bulk_load();
+            bulk_loading_ = true;
+        }
+    }
+    else
+    {
+        end_bulk_load();
+
+        smatch match;
+        bool matched = regex_match(inputline, match, cmds_regex_);
+        if (!matched)
+        {
+            output << "Unknown command!" << endl;
+            return true;
+        }
+
         assert(match.size() == 3);
-        string cmd = match[1];
-        string params = match[2];
+        cmd = match[1];
+        params = match[2];
 
         auto pos = find_if(cmds_.begin(), cmds_.end(), [cmd](CmdInfo const& ci) { return ci.cmd == cmd; });
         assert(pos != cmds_.end());
 
-        smatch match2;
         bool matched2 = regex_match(params, match2, pos->param_regex);
-        if (matched2)
+        if (!matched2)
         {
-            if (pos->func)
-            {
-                assert(!match2.empty());
+            output << "Invalid parameters for command '" << cmd << "'!" << endl;
+            return true;
+        }
+        if (!pos->func)
+        { // No function to run = quit command
+            return false;
+        }
 
-                Stopwatch stopwatch;
-                bool use_stopwatch = (stopwatch_mode != StopwatchMode::OFF);
-                // Reset stopwatch mode if only for the next command
-                if (stopwatch_mode == StopwatchMode::NEXT) { stopwatch_mode = StopwatchMode::OFF; }
+        assert(!match2.empty());
+        auto func = pos->func;
+        command = [this, func, &match2](std::ostream& out){ return (this->*func)(out, ++(match2.begin()), match2.end()); };
+    }
 
-               TestStatus initial_status = test_status_;
-               test_status_ = TestStatus::NOT_RUN;
+    bool use_stopwatch = (stopwatch_mode != StopwatchMode::OFF);
+    Stopwatch stopwatch(use_stopwatch); // Counters are only opened when timing
+    // Reset stopwatch mode if only for the next command
+    if (stopwatch_mode == StopwatchMode::NEXT) { stopwatch_mode = StopwatchMode::OFF; }
 
-                if (use_stopwatch)
-                {
-                    stopwatch.start();
-                }
+    TestStatus initial_status = test_status_;
+    test_status_ = TestStatus::NOT_RUN;
 
-                CmdResult result;
-                try
-                {
-                    result = (this->*(pos->func))(output, ++(match2.begin()), match2.end());
-                }
-                catch (std::exception const& e)
-                {
-                    output << "Error: " << e.what() << endl;
-                }
+    if (use_stopwatch)
+    {
+        stopwatch.start();
+    }
 
-                if (use_stopwatch)
+    CmdResult result;
+    try
+    {
+        result = command(output);
+    }
+    catch (std::exception const& e)
+    {
+        output << "Error: " << e.what() << endl;
+    }
+
+    if (use_stopwatch)
+    {
+        stopwatch.stop();
+    }
+
+    switch (result.first)
+    {
+        case ResultType::NOTHING:
+        {
+            break;
+        }
+        case ResultType::PLACEIDLIST:
+        {
+            auto& [area, places] = std::get<CmdResultPlaceIDs>(result.second);
+            if (area != NO_AREA)
+            {
+                output << "Area: ";
+                print_area(area, output);
+            }
+            if (!places.empty())
+            {
+                if (places.size() == 1 && places.front() == NO_PLACE)
                 {
-                    stopwatch.stop();
+                    output << "Failed (NO_... returned)!!" << std::endl;
                 }
-
-                switch (result.first)
+                else
                 {
-                    case ResultType::NOTHING:
-                    {
-                        break;
-                    }
-                    case ResultType::PLACEIDLIST:
-                    {
-                        auto& [area, places] = std::get<CmdResultPlaceIDs>(result.second);
-                        if (area != NO_AREA)
-                        {
-                            output << "Area: ";
-                            print_area(area, output);
-                        }
-                        if (!places.empty())
-                        {
-                            if (places.size() == 1 && places.front() == NO_PLACE)
-                            {
-                                output << "Failed (NO_... returned)!!" << std::endl;
-                            }
-                            else
-                            {
-                                unsigned int num = 0;
-                                for (PlaceID id : places)
-                                {
-                                    ++num;
-                                    if (places.size() > 1) { output << num << ". "; }
-                                    print_place(id, output);
-                                }
-                            }
-                        }
-                        break;
-                    }
-                    case ResultType::AREAIDLIST:
+                    unsigned int num = 0;
+                    for (PlaceID id : places)
                     {
-                        auto& areas = std::get<CmdResultAreaIDs>(result.second);
-                        if (!areas.empty())
-                        {
-                            if (areas.size() == 1 && areas.front() == NO_AREA)
-                            {
-                                output << "Failed (NO_... returned)!!" << std::endl;
-                            }
-                            else
-                            {
-                                unsigned int num = 0;
-                                for (auto area : areas)
-                                {
-                                    ++num;
-                                    if (areas.size() > 1) { output << num << ". "; }
-                                    print_area(area, output);
-                                }
-                            }
-                        }
-                        break;
+                        ++num;
+                        if (places.size() > 1) { output << num << ". "; }
+                        print_place(id, output);
                     }
-                    case ResultType::ROUTE:
-                    {
-                        auto& route = std::get<CmdResultRoute>(result.second);
-                        if (!route.empty())
-                        {
-                            if (route.size() == 1 && get<0>(route.front()) == NO_COORD)
-                            {
-                                output << "Failed (NO_... returned)!!" << std::endl;
-                            }
-                            else
-                            {
-                                unsigned int num = 1;
-                                for (auto& [coord, nextcoord, wayid, distance] : route)
-                                {
-                                    output << num << ". ";
-                                    ++num;
-                                    print_coord(coord, output, false);
-                                    if (wayid != NO_WAY) { output << " way " << wayid; }
-                                    if (distance != NO_DISTANCE) { output << " distance " << distance; }
-                                    output << endl;
-                                }
-                            }
-                        }
-                        break;
-                    }
-                case ResultType::WAYS:
+                }
+            }
+            break;
+        }
+        case ResultType::AREAIDLIST:
+        {
+            auto& areas = std::get<CmdResultAreaIDs>(result.second);
+            if (!areas.empty())
+            {
+                if (areas.size() == 1 && areas.front() == NO_AREA)
                 {
-                    auto& ways = std::get<CmdResultRoute>(result.second);
-                    if (!ways.empty())
-                    {
-                        if (ways.size() == 1 && get<0>(ways.front()) == NO_COORD)
-                        {
-                            output << "Failed (NO_... returned)!!" << std::endl;
-                        }
-                        else
-                        {
-                            unsigned int num = 1;
-                            for (auto& [fromcoord, tocoord, wayid, distance] : ways)
-                            {
-                                output << num << ". ";
-                                ++num;
-                                print_coord(tocoord, output, false);
-                                if (wayid != NO_WAY) { output << " way " << wayid << " "; }
-                                if (distance != NO_DISTANCE) { output << "distance " << distance; }
-                                output << endl;
-                            }
-                        }
-                    }
-                    break;
+                    output << "Failed (NO_... returned)!!" << std::endl;
                 }
-                    default:
+                else
+                {
+                    unsigned int num = 0;
+                    for (auto area : areas)
                     {
-                        assert(false && "Unsupported result type!");
+                        ++num;
+                        if (areas.size() > 1) { output << num << ". "; }
+                        print_area(area, output);
                     }
                 }
-
-                if (result != prev_result)
+            }
+            break;
+        }
+        case ResultType::ROUTE:
+        {
+            print_route(std::get<CmdResultRoute>(result.second), output);
+            break;
+        }
+    case ResultType::WAYS:
+    {
+        auto& ways = std::get<CmdResultRoute>(result.second);
+        if (!ways.empty())
+        {
+            if (ways.size() == 1 && get<0>(ways.front()) == NO_COORD)
+            {
+                output << "Failed (NO_... returned)!!" << std::endl;
+            }
+            else
+            {
+                unsigned int num = 1;
+                for (auto& [fromcoord, tocoord, wayid, distance] : ways)
                 {
-                    prev_result = move(result);
-                    view_dirty = true;
+                    output << num << ". ";
+                    ++num;
+                    print_coord(tocoord, output, false);
+                    if (wayid != NO_WAY) { output << " way " << wayid << " "; }
+                    if (distance != NO_DISTANCE) { output << "distance " << distance; }
+                    output << endl;
                 }
+            }
+        }
+        break;
+    }
+        default:
+        {
+            assert(false && "Unsupported result type!");
+        }
+    }
 
-                if (use_stopwatch)
-                {
-                    output << "Command '" << cmd << "': " << stopwatch.elapsed() << " sec" << endl;
-                }
+    if (result != prev_result)
+    {
+        prev_result = move(result);
+        view_dirty = true;
+    }
 
-                if (test_status_ != TestStatus::NOT_RUN)
-                {
-                    output << "Testread-tests have been run, " << ((test_status_ == TestStatus::DIFFS_FOUND) ? "differences found!" : "no differences found.") << endl;
-                }
-                if (test_status_ == TestStatus::NOT_RUN || (test_status_ == TestStatus::NO_DIFFS && initial_status == TestStatus::DIFFS_FOUND))
-                {
-                    test_status_ = initial_status;
-                }
+    if (use_stopwatch)
+    {
+        output << "Command '" << cmd << "': " << stopwatch.elapsed() << " sec" << endl;
+#ifdef USE_PERF_EVENT
+        if (stopwatch.counters_available())
+        {
+            auto counts = stopwatch.counts();
+            output << "Command '" << cmd << "': " << counts[Stopwatch::INSTRUCTIONS] << " instructions";
+            if (stopwatch.counter_available(Stopwatch::CYCLES) && counts[Stopwatch::CYCLES] > 0)
+            {
+                output << ", IPC " << static_cast<double>(counts[Stopwatch::INSTRUCTIONS]) / counts[Stopwatch::CYCLES];
             }
-            else
-            { // No function to run = quit command
-                return false;
+            if (stopwatch.counter_available(Stopwatch::CACHE_MISSES))
+            {
+                output << ", " << counts[Stopwatch::CACHE_MISSES] << " cache misses";
             }
+            if (stopwatch.counter_available(Stopwatch::BRANCH_MISSES))
+            {
+                output << ", " << counts[Stopwatch::BRANCH_MISSES] << " branch misses";
+            }
+            if (stopwatch.counter_available(Stopwatch::LLC_LOADS))
+            {
+                output << ", " << counts[Stopwatch::LLC_LOADS] << " LLC loads";
+            }
+            output << endl;
         }
-        else
-        {
-            output << "Invalid parameters for command '" << cmd << "'!" << endl;
-        }
+#endif
     }
-    else
+
+    if (test_status_ != TestStatus::NOT_RUN)
     {
-        output << "Unknown command!" << endl;
+        output << "Testread-tests have been run, " << ((test_status_ == TestStatus::DIFFS_FOUND) ? "differences found!" : "no differences found.") << endl;
+    }
+    if (test_status_ == TestStatus::NOT_RUN || (test_status_ == TestStatus::NO_DIFFS && initial_status == TestStatus::DIFFS_FOUND))
+    {
+        test_status_ = initial_status;
     }
 
     return true; // Signal continuing
@@ -2043,6 +3057,7 @@ void MainProgram::command_parser(istream& input, ostream& output, PromptStyle pr
     while (input);
     //    if (promptstyle != PromptStyle::NO_NESTING) { --nesting_level; }
 
+    end_bulk_load();
     view_dirty = true; // To be safe, assume that results have been changed
 }
 
@@ -2125,7 +3140,11 @@ int MainProgram::mainprogram(int argc, char* argv[])
     }
 
     cerr << "Program ended normally." << endl;
-    if (mainprg.test_status_ == TestStatus::DIFFS_FOUND)
+    if (mainprg.complexity_regression_)
+    {
+        cerr << "Perftest found operations worse than expected!" << endl;
+    }
+    if (mainprg.test_status_ == TestStatus::DIFFS_FOUND || mainprg.complexity_regression_)
     {
         return EXIT_FAILURE;
     }
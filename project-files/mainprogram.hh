@@ -10,6 +10,7 @@
 
 
 #include <string>
+#include <string_view>
 #include <random>
 #include <regex>
 #include <chrono>
@@ -17,10 +18,12 @@
 #include <stdexcept>
 #include <iostream>
 #include <vector>
+#include <unordered_map>
 #include <array>
 #include <functional>
 #include <utility>
 #include <variant>
+#include <optional>
 #include <bitset>
 #include <cassert>
 
@@ -84,6 +87,11 @@ private:
     bool view_dirty = true;
 
     TestStatus test_status_ = TestStatus::NOT_RUN;
+    // Set when a perftest fit finds an operation worse than expected, makes the program exit with EXIT_FAILURE
+    bool complexity_regression_ = false;
+
+    // Snapshot kept by "snapshot hold", queried by the other snapshot commands while the data changes
+    std::shared_ptr<Datastructures::snapshot const> held_snapshot_;
 
     using MatchIter = std::smatch::const_iterator;
     struct CmdInfo
@@ -138,15 +146,103 @@ private:
     CmdResult cmd_route_shortest_distance(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_route_with_cycle(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_trim_ways(std::ostream& output, MatchIter begin, MatchIter end);
+
+    // The batch route commands, MFUNC is one of the Datastructures batch route operations
+    using RouteBatchFunc = std::vector<std::vector<std::tuple<Coord, WayID, Distance>>>(Datastructures::*)(std::vector<std::pair<Coord, Coord>> const&);
+    template<RouteBatchFunc MFUNC>
+    CmdResult RouteBatchCmd(std::ostream& output, MatchIter begin, MatchIter end);
+    template<RouteBatchFunc MFUNC>
+    void RouteBatchTestCmd();
+    static unsigned int const ROUTE_BATCH_TEST_SIZE = 16; // Queries in one perftest call
+    std::vector<std::pair<Coord, Coord>> parse_coord_pairs(std::string const& coordsstr);
+    void print_route_batch(std::ostream& output, std::vector<std::pair<Coord, Coord>> const& queries,
+                           std::vector<std::vector<std::tuple<Coord, WayID, Distance>>> const& routes);
     CmdResult cmd_random_add(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_ways(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_randseed(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_read(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_testread(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_save_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_load_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_save_graph_file(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_graph_file_route(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_snapshot(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_read_data(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_stopwatch(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_perftest(std::ostream& output, MatchIter begin, MatchIter end);
+
+    // Measurements of one perftest N for the csv/json report. Every call of a test command is timed
+    // separately, instructions are counted only with USE_PERF_EVENT.
+    struct PerftestCmdStats
+    {
+        std::string cmd;
+        std::vector<double> latencies;
+        // Hardware counter totals over all calls, -1 if the counter is not available
+        long long cycles = 0;
+        long long instructions = 0;
+        long long cache_misses = 0;
+        long long branch_misses = 0;
+        long long llc_loads = 0;
+    };
+    struct PerftestRound
+    {
+        unsigned int n = 0;
+        double addsec = 0;
+        double cmdssec = 0;
+        std::vector<PerftestCmdStats> cmds;
+    };
+#ifdef USE_PERF_EVENT
+    // Counter columns of the perftest report, no value if the counter was not available
+    static std::vector<std::pair<std::string, std::optional<double>>> perftest_counter_values(PerftestCmdStats const& cmdstats);
+#endif
+    bool write_perftest_report(std::string const& format, std::string const& filename, std::vector<PerftestRound> const& rounds);
+
+    // Complexity classes perftest fits the measured times against, in increasing order
+    enum class Complexity { CONSTANT, LOGN, LINEAR, NLOGN, QUADRATIC };
+    static std::unordered_map<std::string, Complexity> const expected_complexity_;
+    struct ComplexityFit
+    {
+        Complexity best = Complexity::CONSTANT;
+        double confidence = 0;
+        std::array<double, 5> errors = {}; // Standard deviation of ln(t/f(n)) for every model
+        double exponent = 0; // Growth of the times as a power of n
+    };
+    static double complexity_value(Complexity complexity, double n);
+    static ComplexityFit fit_complexity(std::vector<std::pair<double, double>> const& times);
+    void print_complexity_fit(std::ostream& output, std::vector<PerftestRound> const& rounds);
     CmdResult cmd_comment(std::ostream& output, MatchIter begin, MatchIter end);
 
+    // The bulk data commands after their parameters have been parsed
+    CmdResult add_place(std::ostream& output, PlaceID id, Name const& name, std::string const& typestr, Coord xy);
+    CmdResult add_area(std::ostream& output, AreaID id, Name const& name, std::vector<Coord> const& coords);
+    CmdResult add_way(std::ostream& output, WayID const& id, std::vector<Coord> const& coords);
+
+    // Parameters of the data commands
+    struct PlaceRecord { PlaceID id; Name name; std::string typestr; Coord xy; };
+    struct AreaRecord { AreaID id; Name name; std::vector<Coord> coords; };
+    struct SubareaRecord { AreaID id; AreaID parentid; };
+    struct WayRecord { WayID id; std::vector<Coord> coords; };
+    using DataRecord = std::variant<PlaceRecord, AreaRecord, SubareaRecord, WayRecord>;
+    // Hand-written parsing of the data commands, regex matching dominates reading large data files.
+    // Returns false for lines that are not data commands in exactly the format the regexs accept.
+    static bool parse_data_line(std::string_view line, DataRecord& record);
+
+    // Lines the fast parser doesn't accept are left to the regex parsing, which also reports the errors
+    using ParsedCmd = std::function<CmdResult(std::ostream& output)>;
+    bool fast_parse_line(std::string const& inputline, std::string& cmd, ParsedCmd& command);
+
+    // Records of one data file parsed by read_data, in file order
+    struct StagedFile
+    {
+        std::string filename;
+        std::vector<DataRecord> records;
+        std::string error;
+    };
+    static void stage_data_file(StagedFile& file);
+    // True while consecutive bulk data commands are loaded in a Datastructures bulk load session
+    bool bulk_loading_ = false;
+    void end_bulk_load();
+
     void test_random_add();
     void test_random_ways();
     void test_place_name_type();
@@ -177,6 +273,7 @@ private:
     std::string print_area(AreaID id, std::ostream& output, bool nl = true);
     std::string print_way(WayID id, std::ostream& output, bool nl = true);
     std::string print_coord(Coord coord, std::ostream& output, bool nl = true);
+    void print_route(CmdResultRoute const& route, std::ostream& output);
 
     template <typename Type>
     Type random(Type start, Type end);
@@ -269,8 +366,35 @@ void MainProgram::NoParPlaceListTestCmd()
     (ds_.*MFUNC)();
 }
 
+template<MainProgram::RouteBatchFunc MFUNC>
+MainProgram::CmdResult MainProgram::RouteBatchCmd(std::ostream& output, MatchIter begin, MatchIter end)
+{
+    std::string coordsstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto queries = parse_coord_pairs(coordsstr);
+    auto routes = (ds_.*MFUNC)(queries);
+    print_route_batch(output, queries, routes);
+
+    return {};
+}
+
+template<MainProgram::RouteBatchFunc MFUNC>
+void MainProgram::RouteBatchTestCmd()
+{
+    std::vector<std::pair<Coord, Coord>> queries;
+    for (unsigned int i = 0; i < ROUTE_BATCH_TEST_SIZE; ++i)
+    {
+        // Choose two random places
+        queries.push_back({n_to_coord(random(decltype(random_ways_added_)(0),random_ways_added_)),
+                           n_to_coord(random(decltype(random_ways_added_)(0),random_ways_added_))});
+    }
+    (ds_.*MFUNC)(queries);
+}
+
 
 #ifdef USE_PERF_EVENT
+#include <cstring>
 extern "C"
 {
 #include <unistd.h>
@@ -296,23 +420,18 @@ class MainProgram::Stopwatch
 public:
     using Clock = std::chrono::high_resolution_clock;
 
+#ifdef USE_PERF_EVENT
+    // Hardware counters, measured as one perf event group so that they are all read at the same time
+    enum Counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, LLC_LOADS, COUNTER_COUNT };
+    using Counts = std::array<long long, COUNTER_COUNT>;
+#endif
+
     Stopwatch(bool use_counter = false) : use_counter_(use_counter)
     {
 #ifdef USE_PERF_EVENT
         if (use_counter_)
         {
-            memset(&pe_, 0, sizeof(pe_));
-            pe_.type = PERF_TYPE_HARDWARE;
-            pe_.size = sizeof(pe_);
-            pe_.config = PERF_COUNT_HW_INSTRUCTIONS;
-            pe_.disabled = 1;
-            pe_.exclude_kernel = 1;
-            pe_.exclude_hv = 1;
-
-            fd_ = perf_event_open(&pe_, 0, -1, -1, 0);
-            if (fd_ == -1) {
-                throw "Couldn't open perf events!";
-            }
+            open_counters();
         }
 #endif
         reset();
@@ -321,23 +440,25 @@ public:
     ~Stopwatch()
     {
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        for (int fd : fds_)
         {
-            close(fd_);
+            if (fd != -1) { close(fd); }
         }
 #endif
     }
 
+    Stopwatch(Stopwatch const&) = delete;
+    Stopwatch& operator=(Stopwatch const&) = delete;
+
     void start()
     {
         running_ = true;
         starttime_ = Clock::now();
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (counters_available())
         {
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            read(fd_, &startcount_, sizeof(startcount_));
-            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            read_group(startcounts_, startenabled_, startrunning_);
+            ioctl(leader_fd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
         }
 #endif
     }
@@ -346,11 +467,10 @@ public:
     {
         running_ = false;
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (counters_available())
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            long long c; read(fd_, &c, sizeof(c));
-            counter_ += (c - startcount_);
+            ioctl(leader_fd_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            counts_ = add_delta(counts_);
         }
 #endif
         elapsed_ += (Clock::now() - starttime_);
@@ -360,12 +480,11 @@ public:
     {
         running_ = false;
 #ifdef USE_PERF_EVENT
-        if (use_counter_)
+        if (counters_available())
         {
-            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
-            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
-            counter_ = 0;
+            ioctl(leader_fd_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
         }
+        counts_ = {};
 #endif
         elapsed_ = elapsed_.zero();
     }
@@ -384,25 +503,20 @@ public:
     }
 
 #ifdef USE_PERF_EVENT
+    // False if no counter could be opened (e.g. perf events are not allowed in a container), then
+    // only the time is measured and all counts are 0
+    bool counters_available() const { return leader_fd_ != -1; }
+    bool counter_available(Counter counter) const { return fds_[counter] != -1; }
+
+    Counts counts()
+    {
+        assert(use_counter_ && "perf_event not enabled during StopWatch creation!");
+        return running_ ? add_delta(counts_) : counts_;
+    }
+
     long long count()
     {
-        if (use_counter_)
-        {
-            if (!running_)
-            {
-                return counter_;
-            }
-            else
-            {
-                long long c;
-                read(fd_, &c, sizeof(c));
-                return counter_ + (c - startcount_);
-            }
-        }
-        else
-        {
-            assert(!"perf_event not enabled during StopWatch creation!");
-        }
+        return counts()[INSTRUCTIONS];
     }
 #endif
 
@@ -413,10 +527,84 @@ private:
 
     bool use_counter_;
 #ifdef USE_PERF_EVENT
-    struct perf_event_attr pe_;
-    long long startcount_ = 0;
-    long long counter_ = 0;
-    int fd_ = 0;
+    std::array<int, COUNTER_COUNT> fds_ = {-1, -1, -1, -1, -1};
+    int leader_fd_ = -1;
+    // Counters in the order they were added to the group, which is the order the group is read in
+    std::array<Counter, COUNTER_COUNT> group_order_ = {};
+    std::size_t group_size_ = 0;
+    Counts counts_ = {};
+    Counts startcounts_ = {};
+    unsigned long long startenabled_ = 0;
+    unsigned long long startrunning_ = 0;
+
+    // Counters that cannot be opened are left out, the first one that can is the group leader
+    void open_counters()
+    {
+        struct { std::uint32_t type; std::uint64_t config; } const events[COUNTER_COUNT] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+        };
+
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter)
+        {
+            struct perf_event_attr pe;
+            memset(&pe, 0, sizeof(pe));
+            pe.type = events[counter].type;
+            pe.size = sizeof(pe);
+            pe.config = events[counter].config;
+            pe.disabled = (leader_fd_ == -1) ? 1 : 0; // Members follow the leader
+            pe.exclude_kernel = 1;
+            pe.exclude_hv = 1;
+            pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            int fd = perf_event_open(&pe, 0, -1, leader_fd_, 0);
+            if (fd == -1) { continue; }
+            if (leader_fd_ == -1) { leader_fd_ = fd; }
+            fds_[counter] = fd;
+            group_order_[group_size_++] = static_cast<Counter>(counter);
+        }
+    }
+
+    bool read_group(Counts& values, unsigned long long& enabled, unsigned long long& running)
+    {
+        std::array<std::uint64_t, 3 + COUNTER_COUNT> buffer = {};
+        if (read(leader_fd_, buffer.data(), sizeof(buffer)) < static_cast<ssize_t>((3 + group_size_) * sizeof(std::uint64_t)))
+        {
+            return false;
+        }
+        enabled = buffer[1];
+        running = buffer[2];
+        values = {};
+        for (std::size_t i = 0; i < group_size_; ++i)
+        {
+            values[group_order_[i]] = buffer[3 + i];
+        }
+        return true;
+    }
+
+    // Adds the counts since start() to base. If the kernel had to multiplex the group with other
+    // events, the counts are scaled up by the fraction of time the group was actually counting.
+    Counts add_delta(Counts base)
+    {
+        Counts values;
+        unsigned long long enabled = 0;
+        unsigned long long running = 0;
+        if (!read_group(values, enabled, running)) { return base; }
+
+        double scale = 1.0;
+        if (running > startrunning_ && running - startrunning_ < enabled - startenabled_)
+        {
+            scale = static_cast<double>(enabled - startenabled_) / (running - startrunning_);
+        }
+        for (std::size_t i = 0; i < base.size(); ++i)
+        {
+            base[i] += static_cast<long long>((values[i] - startcounts_[i]) * scale);
+        }
+        return base;
+    }
 #endif
 };
 